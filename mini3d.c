@@ -5,6 +5,22 @@
 // build:
 //   mingw: gcc -O3 mini3d.c -o mini3d.exe -lgdi32
 //   msvc:  cl -O2 -nologo mini3d.c 
+//   linux: gcc -O3 mini3d.c -o mini3d -lm -lpthread    (无窗口，自动使用 headless 模式)
+//
+// headless:
+//   mini3d -n 300 -s texture -o frame%04d.png   渲染 300 帧并逐帧输出
+//   mini3d -n 300 -t 32                         32 线程分块光栅化
+//   mini3d -n 300 -r halfspace                  使用半空间光栅化（默认 trapezoid）
+//   mini3d -n 300 -d                            延迟着色，每个可见像素只计算一次光照
+//   mini3d -n 300 -s normal                     自定义着色器示例：以颜色显示法线
+//   mini3d -n 300 -f bilinear                   纹理采样：bilinear / mip / trilinear
+//   mini3d -n 300 -z                            Z-prepass，先画深度再着色
+//   mini3d -n 300 -b unorm16                    深度缓存格式：float (rhw，即 reversed-Z) / unorm16 / unorm24
+//   mini3d -n 300 -g 10000                      绘制 10000 个立方体组成的场景，BVH 视锥剔除
+//   mini3d -n 300 -i 10000                      同样的 10000 个立方体，一次实例化绘制，每个实例一种颜色
+//   mini3d -n 300 -p 3 -o frame%04d.png         三缓冲：写出图片的同时渲染后面两帧，1 为同步写出
+//   mini3d -n 300 -v - | ffmpeg -i - out.mp4    Y4M 视频流写到标准输出，-e bgra 或 .bgra 文件为原始 BGRA
+//   定义 MINI3D_HEADLESS 后 Windows 下同样可以离屏渲染
 //
 // history:
 //   2007.7.01  skywind  create this file as a tutorial
@@ -16,11 +32,40 @@
 //=====================================================================
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 #include <assert.h>
 
+#if !defined(_WIN32) && !defined(MINI3D_HEADLESS)
+#define MINI3D_HEADLESS		// 非 Windows 平台没有 GDI，只能离屏渲染
+#endif
+
+#ifdef _WIN32
 #include <windows.h>
 #include <tchar.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifndef min
+#define min(a, b) (((a) < (b))? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b))? (a) : (b))
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MINI3D_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#define MINI3D_AVX
+#include <immintrin.h>
+#endif
 
 typedef unsigned int IUINT32;
 
@@ -301,7 +346,7 @@ void matrix_inverse(matrix_t *dest, const matrix_t* origin)
 	float src[16]; /* array of transpose source matrix */
 	float det; /* determinant */
 				/* transpose matrix */
-	for (UINT i = 0; i < 4; i++)
+	for (int i = 0; i < 4; i++)
 	{
 		src[i + 0] = origin->m[i][0];
 		src[i + 4] = origin->m[i][1];
@@ -398,18 +443,88 @@ typedef struct {
 	matrix_t transform;     // transform = world * view * projection
 	matrix_t vp;			// view * projection
 	matrix_t vp_reverse;    // vp逆矩�
+	matrix_t normal;        // world 逆矩阵的转置，用于变换法线
 	float w, h;             // 屏幕大小
+	int dirty;              // 需要重新计算的派生矩阵，TRANSFORM_DIRTY_*
 }	transform_t;
 
+#define TRANSFORM_DIRTY_VP          1		// vp
+#define TRANSFORM_DIRTY_TRANSFORM   2		// transform
+#define TRANSFORM_DIRTY_NORMAL      4		// normal
+#define TRANSFORM_DIRTY_REVERSE     8		// vp_reverse
+#define TRANSFORM_DIRTY_ALL         15
 
-// 矩阵更新 transform = world * view * projection
+// 直接修改了 world、view、projection 之后调用：只标记派生矩阵失效，用到时才重新计算
 void transform_update(transform_t *ts) {
-	matrix_t m;
-	matrix_mul(&m, &ts->world, &ts->view);
-	matrix_mul(&ts->transform, &m, &ts->projection);
-	matrix_mul(&ts->vp, &ts->view, &ts->projection);
-	matrix_clone(&ts->vp_reverse, &ts->vp);
-	matrix_inverse(&ts->vp_reverse, &ts->vp);
+	ts->dirty = TRANSFORM_DIRTY_ALL;
+}
+
+// 替换 world，view、projection 相关的派生矩阵保持有效
+void transform_set_world(transform_t *ts, const matrix_t *world) {
+	ts->world = *world;
+	ts->dirty |= TRANSFORM_DIRTY_TRANSFORM | TRANSFORM_DIRTY_NORMAL;
+}
+
+// 替换 view，world 相关的法线矩阵保持有效
+void transform_set_view(transform_t *ts, const matrix_t *view) {
+	ts->view = *view;
+	ts->dirty |= TRANSFORM_DIRTY_VP | TRANSFORM_DIRTY_TRANSFORM | TRANSFORM_DIRTY_REVERSE;
+}
+
+void transform_set_projection(transform_t *ts, const matrix_t *projection) {
+	ts->projection = *projection;
+	ts->dirty |= TRANSFORM_DIRTY_VP | TRANSFORM_DIRTY_TRANSFORM | TRANSFORM_DIRTY_REVERSE;
+}
+
+// 法线矩阵由 world 左上 3x3 的代数余子式除以行列式得到
+static void transform_update_normal(transform_t *ts) {
+	const float (*m)[4] = ts->world.m;
+	float (*n)[4] = ts->normal.m;
+	float det;
+	int i, j;
+	for (i = 0; i < 3; i++) {	// 代数余子式的第 i 行是另外两行的叉积
+		const float *a = m[(i + 1) % 3], *b = m[(i + 2) % 3];
+		n[i][0] = a[1] * b[2] - a[2] * b[1];
+		n[i][1] = a[2] * b[0] - a[0] * b[2];
+		n[i][2] = a[0] * b[1] - a[1] * b[0];
+		n[i][3] = 0.0f;
+	}
+	det = m[0][0] * n[0][0] + m[0][1] * n[0][1] + m[0][2] * n[0][2];
+	if (det != 0.0f) det = 1.0f / det;
+	for (i = 0; i < 3; i++) 
+		for (j = 0; j < 3; j++) n[i][j] *= det;
+	n[3][0] = n[3][1] = n[3][2] = 0.0f;
+	n[3][3] = 1.0f;
+}
+
+// 计算 vp
+const matrix_t *transform_vp(transform_t *ts) {
+	if (ts->dirty & TRANSFORM_DIRTY_VP) {
+		matrix_mul(&ts->vp, &ts->view, &ts->projection);
+		ts->dirty &= ~TRANSFORM_DIRTY_VP;
+	}
+	return &ts->vp;
+}
+
+// 计算 vp 的逆矩阵，只有延迟光照用到，每次相机改变后最多求一次逆
+const matrix_t *transform_vp_reverse(transform_t *ts) {
+	if (ts->dirty & TRANSFORM_DIRTY_REVERSE) {
+		matrix_inverse(&ts->vp_reverse, transform_vp(ts));
+		ts->dirty &= ~TRANSFORM_DIRTY_REVERSE;
+	}
+	return &ts->vp_reverse;
+}
+
+// 顶点阶段之前调用：计算顶点阶段读取的 transform 和 normal
+void transform_prepare(transform_t *ts) {
+	if (ts->dirty & TRANSFORM_DIRTY_TRANSFORM) {
+		matrix_mul(&ts->transform, &ts->world, transform_vp(ts));
+		ts->dirty &= ~TRANSFORM_DIRTY_TRANSFORM;
+	}
+	if (ts->dirty & TRANSFORM_DIRTY_NORMAL) {
+		transform_update_normal(ts);
+		ts->dirty &= ~TRANSFORM_DIRTY_NORMAL;
+	}
 }
 
 // 初始化，设置屏幕长宽
@@ -423,8 +538,9 @@ void transform_init(transform_t *ts, int width, int height) {
 	transform_update(ts);
 }
 
-// 将矢�x 进行 project 
-void transform_apply(const transform_t *ts, vector_t *y, const vector_t *x) {
+// 将矢�x 进行 project，派生矩阵失效时先重新计算
+void transform_apply(transform_t *ts, vector_t *y, const vector_t *x) {
+	transform_prepare(ts);
 	matrix_apply(y, x, &ts->transform);
 }
 
@@ -458,45 +574,196 @@ void transform_homogenize_reverse(vector_t *y, const vector_t *x, float width, f
 }
 
 
+//=====================================================================
+// 批量顶点变换：结构数组（SoA）布局，AVX 一次 8 个、SSE2 一次 4 个顶点，
+// 结果与逐个调用 matrix_apply / transform_check_cvv / transform_homogenize 一致
+//=====================================================================
+typedef struct { float *x, *y, *z, *w; } vector_soa_t;	// 每个分量一个数组
+
+// y = x * M 的第 c 列，求和顺序同 matrix_apply
+#define BATCH_COLUMN(M, c, X, Y, Z, W) \
+	V_ADD(V_ADD(V_ADD(V_MUL(X, V_SET1((M)->m[0][c])), V_MUL(Y, V_SET1((M)->m[1][c]))), \
+	V_MUL(Z, V_SET1((M)->m[2][c]))), V_MUL(W, V_SET1((M)->m[3][c])))
+
+// 按 LANES 个一组处理，V_* 由调用处定义为对应指令集的运算
+#define BATCH_TRANSFORM(T, LANES) \
+	for (; i + (LANES) <= n; i += (LANES)) { \
+		T zero = V_SET1(0.0f), one = V_SET1(1.0f), half = V_SET1(0.5f); \
+		T x = V_LOAD(pos->x + i), y = V_LOAD(pos->y + i), z = V_LOAD(pos->z + i); \
+		T w = (pos->w)? V_LOAD(pos->w + i) : one; \
+		T cx = BATCH_COLUMN(&ts->transform, 0, x, y, z, w); \
+		T cy = BATCH_COLUMN(&ts->transform, 1, x, y, z, w); \
+		T cz = BATCH_COLUMN(&ts->transform, 2, x, y, z, w); \
+		T cw = BATCH_COLUMN(&ts->transform, 3, x, y, z, w); \
+		T rhw, ncw = V_SUB(zero, cw); \
+		int m0, m1, m2, m3, m4, m5, k; \
+		V_STORE(clip->x + i, cx); \
+		V_STORE(clip->y + i, cy); \
+		V_STORE(clip->z + i, cz); \
+		V_STORE(clip->w + i, cw); \
+		V_STORE(world->x + i, BATCH_COLUMN(&ts->world, 0, x, y, z, w)); \
+		V_STORE(world->y + i, BATCH_COLUMN(&ts->world, 1, x, y, z, w)); \
+		V_STORE(world->z + i, BATCH_COLUMN(&ts->world, 2, x, y, z, w)); \
+		if (normal) { \
+			T nx = V_LOAD(normal->x + i), ny = V_LOAD(normal->y + i), nz = V_LOAD(normal->z + i); \
+			V_STORE(wnormal->x + i, BATCH_COLUMN(&ts->normal, 0, nx, ny, nz, zero)); \
+			V_STORE(wnormal->y + i, BATCH_COLUMN(&ts->normal, 1, nx, ny, nz, zero)); \
+			V_STORE(wnormal->z + i, BATCH_COLUMN(&ts->normal, 2, nx, ny, nz, zero)); \
+		} \
+		m0 = V_MOVEMASK(V_CMPLT(cz, zero)); \
+		m1 = V_MOVEMASK(V_CMPLT(cw, cz)); \
+		m2 = V_MOVEMASK(V_CMPLT(cx, ncw)); \
+		m3 = V_MOVEMASK(V_CMPLT(cw, cx)); \
+		m4 = V_MOVEMASK(V_CMPLT(cy, ncw)); \
+		m5 = V_MOVEMASK(V_CMPLT(cw, cy)); \
+		for (k = 0; k < (LANES); k++) \
+			cvv[i + k] = ((m0 >> k) & 1) | (((m1 >> k) & 1) << 1) | (((m2 >> k) & 1) << 2) | \
+				(((m3 >> k) & 1) << 3) | (((m4 >> k) & 1) << 4) | (((m5 >> k) & 1) << 5); \
+		rhw = V_DIV(one, cw); \
+		V_STORE(screen->x + i, V_MUL(V_MUL(V_ADD(V_MUL(cx, rhw), one), V_SET1(ts->w)), half)); \
+		V_STORE(screen->y + i, V_MUL(V_MUL(V_SUB(one, V_MUL(cy, rhw)), V_SET1(ts->h)), half)); \
+		V_STORE(screen->z + i, V_MUL(cz, rhw)); \
+	}
+
+// 批量变换 n 个顶点：pos 为模型空间坐标（w 为 NULL 时取 1），normal 为模型空间法线（可以为 NULL）；
+// 输出裁剪空间坐标 clip、世界坐标 world（x, y, z）、世界空间法线 wnormal（x, y, z）、
+// cvv 检查结果和屏幕坐标 screen（x, y, z）。w <= 0 的顶点 screen 无意义。
+// 只读 ts，多个线程可以同时调用，调用前需要先 transform_prepare
+void transform_batch(const transform_t *ts, int n, const vector_soa_t *pos, const vector_soa_t *normal, 
+	vector_soa_t *clip, vector_soa_t *world, vector_soa_t *wnormal, vector_soa_t *screen, int *cvv) {
+	int i = 0;
+	assert((ts->dirty & (TRANSFORM_DIRTY_TRANSFORM | TRANSFORM_DIRTY_NORMAL)) == 0);
+#ifdef MINI3D_AVX
+	#define V_LOAD(p)           _mm256_loadu_ps(p)
+	#define V_STORE(p, a)       _mm256_storeu_ps(p, a)
+	#define V_SET1(f)           _mm256_set1_ps(f)
+	#define V_ADD(a, b)         _mm256_add_ps(a, b)
+	#define V_SUB(a, b)         _mm256_sub_ps(a, b)
+	#define V_MUL(a, b)         _mm256_mul_ps(a, b)
+	#define V_DIV(a, b)         _mm256_div_ps(a, b)
+	#define V_CMPLT(a, b)       _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+	#define V_MOVEMASK(a)       _mm256_movemask_ps(a)
+	BATCH_TRANSFORM(__m256, 8)
+	#undef V_LOAD
+	#undef V_STORE
+	#undef V_SET1
+	#undef V_ADD
+	#undef V_SUB
+	#undef V_MUL
+	#undef V_DIV
+	#undef V_CMPLT
+	#undef V_MOVEMASK
+#endif
+#ifdef MINI3D_SSE2
+	#define V_LOAD(p)           _mm_loadu_ps(p)
+	#define V_STORE(p, a)       _mm_storeu_ps(p, a)
+	#define V_SET1(f)           _mm_set1_ps(f)
+	#define V_ADD(a, b)         _mm_add_ps(a, b)
+	#define V_SUB(a, b)         _mm_sub_ps(a, b)
+	#define V_MUL(a, b)         _mm_mul_ps(a, b)
+	#define V_DIV(a, b)         _mm_div_ps(a, b)
+	#define V_CMPLT(a, b)       _mm_cmplt_ps(a, b)
+	#define V_MOVEMASK(a)       _mm_movemask_ps(a)
+	BATCH_TRANSFORM(__m128, 4)
+	#undef V_LOAD
+	#undef V_STORE
+	#undef V_SET1
+	#undef V_ADD
+	#undef V_SUB
+	#undef V_MUL
+	#undef V_DIV
+	#undef V_CMPLT
+	#undef V_MOVEMASK
+#endif
+	for (; i < n; i++) {	// 剩余的顶点
+		vector_t p, c, v;
+		p.x = pos->x[i], p.y = pos->y[i], p.z = pos->z[i];
+		p.w = (pos->w)? pos->w[i] : 1.0f;
+		matrix_apply(&c, &p, &ts->transform);
+		clip->x[i] = c.x, clip->y[i] = c.y, clip->z[i] = c.z, clip->w[i] = c.w;
+		matrix_apply(&v, &p, &ts->world);
+		world->x[i] = v.x, world->y[i] = v.y, world->z[i] = v.z;
+		if (normal) {
+			p.x = normal->x[i], p.y = normal->y[i], p.z = normal->z[i], p.w = 0.0f;
+			matrix_apply(&v, &p, &ts->normal);
+			wnormal->x[i] = v.x, wnormal->y[i] = v.y, wnormal->z[i] = v.z;
+		}
+		cvv[i] = transform_check_cvv(&c);
+		transform_homogenize(ts, &v, &c);
+		screen->x[i] = v.x, screen->y[i] = v.y, screen->z[i] = v.z;
+	}
+}
+
+
 //=====================================================================
 // 几何计算：顶点、扫描线、边缘、矩形、步长计�
 //=====================================================================
 typedef struct { float r, g, b; } color_t;
 typedef struct { float u, v; } texcoord_t;
-typedef struct { point_t pos; texcoord_t tc; color_t color; vector_t normal; float rhw; } vertex_t;
+typedef struct { point_t pos; texcoord_t tc; color_t color; vector_t normal; float rhw; point_t wpos; } vertex_t;
 typedef struct
 {
 	vector_t position;
 	color_t color;
 } light_t;
 
-light_t Light = {
+#define LIGHT_MAX           4		// 每个设备最多的光源数
+
+// 设备初始化时的默认光源
+const light_t light_default = {
 	{2,1,2,1},
 	{255, 255, 255}
 };
 
+//顶点着色器输入，模型空间
 //normal来自模型的tangentspace ((r)0,(g)0,(b)1)法线贴图基本都是蓝色
 typedef struct
 {
-	vertex_t pos;
+	point_t pos;
 	color_t color;
 	vector_t normal;
 	texcoord_t tex;
 }appdata;
 
-//struct to fragment 需要计算得到worldSpace的normal，在fragment阶段做光照计�
+//struct to fragment 需要计算得到worldSpace的normal，在fragment阶段做光照计算
+//顶点阶段输出时 pos 为裁剪空间坐标；片元阶段输入时 pos 为屏幕坐标，w 为 rhw
 typedef struct
 {
 	vector_t pos;
 	texcoord_t tex;
 	color_t color;
 	vector_t normal;
-	vector_t tangent;
+	point_t wpos;
+	texcoord_t tex_ddx;     // 片元阶段纹理坐标沿屏幕 x, y 的导数，用于选择 mip 级别
+	texcoord_t tex_ddy;
 }v2f;
 
-typedef struct { vertex_t v, v1, v2; } edge_t;
-typedef struct { float top, bottom; edge_t left, right; } trapezoid_t;
-typedef struct { vertex_t v, step; int x, y, w; } scanline_t;
+//片元着色器输出的表面
+typedef struct
+{
+	IUINT32 albedo;     // 表面颜色
+	vector_t normal;    // 世界空间单位法线，光照时使用
+}surface_t;
+
+//顶点阶段的结果，device_draw_indexed 中每个顶点只计算一次
+typedef struct
+{
+	v2f out;            // 顶点着色器输出，pos 为裁剪空间坐标
+	point_t screen;     // 归一化后的屏幕坐标，w > 0 时有效
+	int cvv;            // transform_check_cvv 的结果
+}vertex_post_t;
+
+#define VARYING_TEXCOORD    1		// v2f.tex
+#define VARYING_COLOR       2		// v2f.color
+#define VARYING_NORMAL      4		// v2f.normal
+#define VARYING_WPOS        8		// v2f.wpos
+#define VARYING_TEXGRAD     16		// v2f.tex_ddx, v2f.tex_ddy，同时插值 v2f.tex
+
+#define VERTEX_FLOATS       ((int)(sizeof(vertex_t) / sizeof(float)))
+
+typedef struct { vertex_t v, v1, v2, step; } edge_t;	// step 为沿边每下移一行的增量
+typedef struct { float top, bottom; edge_t left, right; vertex_t step, ddy; } trapezoid_t;	// step, ddy 为三角形的 x, y 方向梯度
+typedef struct { vertex_t v, step; const vertex_t *ddy; int x, y, w; } scanline_t;
 
 
 void vertex_rhw_init(vertex_t *v) {
@@ -507,58 +774,154 @@ void vertex_rhw_init(vertex_t *v) {
 	v->color.r *= rhw;
 	v->color.g *= rhw;
 	v->color.b *= rhw;
+	v->normal.x *= rhw;
+	v->normal.y *= rhw;
+	v->normal.z *= rhw;
+	v->wpos.x *= rhw;
+	v->wpos.y *= rhw;
+	v->wpos.z *= rhw;
 }
-//顶点法向量变换矩阵逆矩阵的转置
-void vertex_normal_transform(vertex_t * v, matrix_t * transform)
-{
-	matrix_apply(&v->normal, &v->normal, transform);
+//顶点着色器的输出转为光栅化用的顶点，screen 为归一化后的屏幕坐标
+void vertex_init_v2f(vertex_t *v, const v2f *o, const point_t *screen) {
+	v->pos = *screen;
+	v->pos.w = o->pos.w;
+	v->tc = o->tex;
+	v->color = o->color;
+	v->normal = o->normal;
+	v->wpos = o->wpos;
+	vertex_rhw_init(v);
 }
 
-void vertex_interp(vertex_t *y, const vertex_t *x1, const vertex_t *x2, float t) {
+// 以下按 VARYING_* 掩码 mask 只处理需要插值的属性，rhw 总是处理；
+// mask 为常量时未使用属性的运算在编译期消除
+void vertex_interp(vertex_t *y, const vertex_t *x1, const vertex_t *x2, float t, int mask) {
 	vector_interp(&y->pos, &x1->pos, &x2->pos, t);
-	vector_interp(&y->normal, &x1->normal, &x2->normal, t);
-	y->tc.u = interp(x1->tc.u, x2->tc.u, t);
-	y->tc.v = interp(x1->tc.v, x2->tc.v, t);
-	y->color.r = interp(x1->color.r, x2->color.r, t);
-	y->color.g = interp(x1->color.g, x2->color.g, t);
-	y->color.b = interp(x1->color.b, x2->color.b, t);
+	y->pos.w = interp(x1->pos.w, x2->pos.w, t);		// vector_interp 会把 w 置 1
 	y->rhw = interp(x1->rhw, x2->rhw, t);
+	if (mask & VARYING_TEXCOORD) {
+		y->tc.u = interp(x1->tc.u, x2->tc.u, t);
+		y->tc.v = interp(x1->tc.v, x2->tc.v, t);
+	}
+	if (mask & VARYING_COLOR) {
+		y->color.r = interp(x1->color.r, x2->color.r, t);
+		y->color.g = interp(x1->color.g, x2->color.g, t);
+		y->color.b = interp(x1->color.b, x2->color.b, t);
+	}
+	if (mask & VARYING_NORMAL) vector_interp(&y->normal, &x1->normal, &x2->normal, t);
+	if (mask & VARYING_WPOS) vector_interp(&y->wpos, &x1->wpos, &x2->wpos, t);
 }
 
-void vertex_division(vertex_t *y, const vertex_t *x1, const vertex_t *x2, float w) {
+void vertex_division(vertex_t *y, const vertex_t *x1, const vertex_t *x2, float w, int mask) {
 	float inv = 1.0f / w;
 	y->pos.x = (x2->pos.x - x1->pos.x) * inv;
 	y->pos.y = (x2->pos.y - x1->pos.y) * inv;
 	y->pos.z = (x2->pos.z - x1->pos.z) * inv;
 	y->pos.w = (x2->pos.w - x1->pos.w) * inv;
-	y->tc.u = (x2->tc.u - x1->tc.u) * inv;
-	y->tc.v = (x2->tc.v - x1->tc.v) * inv;
-	y->color.r = (x2->color.r - x1->color.r) * inv;
-	y->color.g = (x2->color.g - x1->color.g) * inv;
-	y->color.b = (x2->color.b - x1->color.b) * inv;
-	/*y->normal.x = (x2->normal.x - x1->normal.x) * inv;
-	y->normal.y = (x2->normal.y - x1->normal.y) * inv;
-	y->normal.z = (x2->normal.z - x1->normal.z) * inv;*/
 	y->rhw = (x2->rhw - x1->rhw) * inv;
+	if (mask & VARYING_TEXCOORD) {
+		y->tc.u = (x2->tc.u - x1->tc.u) * inv;
+		y->tc.v = (x2->tc.v - x1->tc.v) * inv;
+	}
+	if (mask & VARYING_COLOR) {
+		y->color.r = (x2->color.r - x1->color.r) * inv;
+		y->color.g = (x2->color.g - x1->color.g) * inv;
+		y->color.b = (x2->color.b - x1->color.b) * inv;
+	}
+	if (mask & VARYING_NORMAL) {
+		y->normal.x = (x2->normal.x - x1->normal.x) * inv;
+		y->normal.y = (x2->normal.y - x1->normal.y) * inv;
+		y->normal.z = (x2->normal.z - x1->normal.z) * inv;
+	}
+	if (mask & VARYING_WPOS) {
+		y->wpos.x = (x2->wpos.x - x1->wpos.x) * inv;
+		y->wpos.y = (x2->wpos.y - x1->wpos.y) * inv;
+		y->wpos.z = (x2->wpos.z - x1->wpos.z) * inv;
+	}
 }
 
-void vertex_add(vertex_t *y, const vertex_t *x) {
-	y->pos.x += x->pos.x;
-	y->pos.y += x->pos.y;
-	y->pos.z += x->pos.z;
-	y->pos.w += x->pos.w;
+// 逐像素步进，片元阶段不读 pos，因此不累加 pos
+void vertex_add(vertex_t *y, const vertex_t *x, int mask) {
 	y->rhw += x->rhw;
-	y->tc.u += x->tc.u;
-	y->tc.v += x->tc.v;
-	y->color.r += x->color.r;
-	y->color.g += x->color.g;
-	y->color.b += x->color.b;
+	if (mask & VARYING_TEXCOORD) {
+		y->tc.u += x->tc.u;
+		y->tc.v += x->tc.v;
+	}
+	if (mask & VARYING_COLOR) {
+		y->color.r += x->color.r;
+		y->color.g += x->color.g;
+		y->color.b += x->color.b;
+	}
+	if (mask & VARYING_NORMAL) {
+		y->normal.x += x->normal.x;
+		y->normal.y += x->normal.y;
+		y->normal.z += x->normal.z;
+	}
+	if (mask & VARYING_WPOS) {
+		y->wpos.x += x->wpos.x;
+		y->wpos.y += x->wpos.y;
+		y->wpos.z += x->wpos.z;
+	}
+}
+
+// y = x + step * n，直接定位到扫描线上第 n 个像素，同样不处理 pos
+void vertex_seek(vertex_t *y, const vertex_t *x, const vertex_t *step, float n, int mask) {
+	y->rhw = x->rhw + step->rhw * n;
+	if (mask & VARYING_TEXCOORD) {
+		y->tc.u = x->tc.u + step->tc.u * n;
+		y->tc.v = x->tc.v + step->tc.v * n;
+	}
+	if (mask & VARYING_COLOR) {
+		y->color.r = x->color.r + step->color.r * n;
+		y->color.g = x->color.g + step->color.g * n;
+		y->color.b = x->color.b + step->color.b * n;
+	}
+	if (mask & VARYING_NORMAL) {
+		y->normal.x = x->normal.x + step->normal.x * n;
+		y->normal.y = x->normal.y + step->normal.y * n;
+		y->normal.z = x->normal.z + step->normal.z * n;
+	}
+	if (mask & VARYING_WPOS) {
+		y->wpos.x = x->wpos.x + step->wpos.x * n;
+		y->wpos.y = x->wpos.y + step->wpos.y * n;
+		y->wpos.z = x->wpos.z + step->wpos.z * n;
+	}
+}
+
+// 求三角形上各属性的屏幕空间梯度，ddy 可以为 NULL；退化三角形返回 0
+int vertex_gradient(vertex_t *ddx, vertex_t *ddy, const vertex_t *p1, 
+	const vertex_t *p2, const vertex_t *p3) {
+	const float *f0 = (const float*)p1, *f1 = (const float*)p2, *f2 = (const float*)p3;
+	float *gx = (float*)ddx, *gy = (float*)ddy;
+	float dx1 = p2->pos.x - p1->pos.x, dy1 = p2->pos.y - p1->pos.y;
+	float dx2 = p3->pos.x - p1->pos.x, dy2 = p3->pos.y - p1->pos.y;
+	float area = dx1 * dy2 - dx2 * dy1, inv;
+	int i;
+	if (area == 0.0f) return 0;
+	inv = 1.0f / area;
+	for (i = 0; i < VERTEX_FLOATS; i++) {	// vertex_t 全部由 float 组成，逐分量求平面梯度
+		float d1 = f1[i] - f0[i], d2 = f2[i] - f0[i];
+		gx[i] = (d1 * dy2 - d2 * dy1) * inv;
+		if (gy) gy[i] = (d2 * dx1 - d1 * dx2) * inv;
+	}
+	return 1;
+}
+
+// 计算梯形两条边的纵向增量，x 方向梯度整个三角形共用
+static void trapezoid_init_edges(trapezoid_t *trap, const vertex_t *ddx, const vertex_t *ddy) {
+	edge_t *e[2];
+	int i;
+	e[0] = &trap->left, e[1] = &trap->right;
+	for (i = 0; i < 2; i++) 
+		vertex_division(&e[i]->step, &e[i]->v1, &e[i]->v2, e[i]->v2.pos.y - e[i]->v1.pos.y, ~0);
+	trap->step = *ddx;
+	trap->ddy = *ddy;
 }
 
 // 根据三角形生�0-2 个梯形，并且返回合法梯形的数�
 int trapezoid_init_triangle(trapezoid_t *trap, const vertex_t *p1, 
 	const vertex_t *p2, const vertex_t *p3) {
 	const vertex_t *p;
+	vertex_t ddx, ddy;
 	float k, x;
 
 	if (p1->pos.y > p2->pos.y) p = p1, p1 = p2, p2 = p;
@@ -566,6 +929,7 @@ int trapezoid_init_triangle(trapezoid_t *trap, const vertex_t *p1,
 	if (p2->pos.y > p3->pos.y) p = p2, p2 = p3, p3 = p;
 	if (p1->pos.y == p2->pos.y && p1->pos.y == p3->pos.y) return 0;
 	if (p1->pos.x == p2->pos.x && p1->pos.x == p3->pos.x) return 0;
+	if (vertex_gradient(&ddx, &ddy, p1, p2, p3) == 0) return 0;
 
 	if (p1->pos.y == p2->pos.y) {	// triangle down
 		if (p1->pos.x > p2->pos.x) p = p1, p1 = p2, p2 = p;
@@ -575,7 +939,9 @@ int trapezoid_init_triangle(trapezoid_t *trap, const vertex_t *p1,
 		trap[0].left.v2 = *p3;
 		trap[0].right.v1 = *p2;
 		trap[0].right.v2 = *p3;
-		return (trap[0].top < trap[0].bottom)? 1 : 0;
+		if (trap[0].top >= trap[0].bottom) return 0;
+		trapezoid_init_edges(&trap[0], &ddx, &ddy);
+		return 1;
 	}
 
 	if (p2->pos.y == p3->pos.y) {	// triangle up
@@ -586,7 +952,9 @@ int trapezoid_init_triangle(trapezoid_t *trap, const vertex_t *p1,
 		trap[0].left.v2 = *p2;
 		trap[0].right.v1 = *p1;
 		trap[0].right.v2 = *p3;
-		return (trap[0].top < trap[0].bottom)? 1 : 0;
+		if (trap[0].top >= trap[0].bottom) return 0;
+		trapezoid_init_edges(&trap[0], &ddx, &ddy);
+		return 1;
 	}
 
 	trap[0].top = p1->pos.y;
@@ -617,28 +985,41 @@ int trapezoid_init_triangle(trapezoid_t *trap, const vertex_t *p1,
 		trap[1].right.v2 = *p3;
 	}
 
+	trapezoid_init_edges(&trap[0], &ddx, &ddy);
+	trapezoid_init_edges(&trap[1], &ddx, &ddy);
 	return 2;
 }
 
-// 按照 Y 坐标计算出左右两条边纵坐标等�Y 的顶�
-void trapezoid_edge_interp(trapezoid_t *trap, float y) {
-	float s1 = trap->left.v2.pos.y - trap->left.v1.pos.y;
-	float s2 = trap->right.v2.pos.y - trap->right.v1.pos.y;
-	float t1 = (y - trap->left.v1.pos.y) / s1;
-	float t2 = (y - trap->right.v1.pos.y) / s2;
-	vertex_interp(&trap->left.v, &trap->left.v1, &trap->left.v2, t1);
-	vertex_interp(&trap->right.v, &trap->right.v1, &trap->right.v2, t2);
+// 按照 Y 坐标直接定位左右两条边上纵坐标等于 Y 的顶点
+void trapezoid_edge_interp(trapezoid_t *trap, float y, int mask) {
+	edge_t *e[2];
+	int i;
+	e[0] = &trap->left, e[1] = &trap->right;
+	for (i = 0; i < 2; i++) {
+		float t = y - e[i]->v1.pos.y;
+		e[i]->v.pos.x = e[i]->v1.pos.x + e[i]->step.pos.x * t;
+		vertex_seek(&e[i]->v, &e[i]->v1, &e[i]->step, t, mask);
+	}
+}
+
+// 左右两条边下移一行
+void trapezoid_edge_step(trapezoid_t *trap, int mask) {
+	trap->left.v.pos.x += trap->left.step.pos.x;
+	trap->right.v.pos.x += trap->right.step.pos.x;
+	vertex_add(&trap->left.v, &trap->left.step, mask);
+	vertex_add(&trap->right.v, &trap->right.step, mask);
 }
 
-// 根据左右两边的端点，初始化计算出扫描线的起点和步�
-void trapezoid_init_scan_line(const trapezoid_t *trap, scanline_t *scanline, int y) {
-	float width = trap->right.v.pos.x - trap->left.v.pos.x;
+// 根据左边的顶点，初始化扫描线的起点（第一个像素中心处的属性）和步长
+void trapezoid_init_scan_line(const trapezoid_t *trap, scanline_t *scanline, int y, int mask) {
 	scanline->x = (int)(trap->left.v.pos.x + 0.5f);
 	scanline->w = (int)(trap->right.v.pos.x + 0.5f) - scanline->x;
 	scanline->y = y;
-	scanline->v = trap->left.v;
 	if (trap->left.v.pos.x >= trap->right.v.pos.x) scanline->w = 0;
-	vertex_division(&scanline->step, &trap->left.v, &trap->right.v, width);
+	vertex_seek(&scanline->v, &trap->left.v, &trap->step, 
+		(float)scanline->x + 0.5f - trap->left.v.pos.x, mask);
+	scanline->step = trap->step;
+	scanline->ddy = &trap->ddy;
 }
 
 //math from https://blog.csdn.net/bonchoix/article/details/8619624
@@ -646,8 +1027,8 @@ void trapezoid_init_scan_line(const trapezoid_t *trap, scanline_t *scanline, int
 void CalculateTangent(vector_t *tangent, vector_t p0, vector_t p1, vector_t p2,
 	float u0, float v0, float u1, float v1, float u2, float v2)
 {
-	vector_t* p01;
-	vector_t* p02;
+	vector_t p01;
+	vector_t p02;
 	vector_sub(&p01, &p1, &p0);
 	vector_sub(&p02, &p2, &p0);
 	float b1 = v1 - v0;
@@ -655,160 +1036,956 @@ void CalculateTangent(vector_t *tangent, vector_t p0, vector_t p1, vector_t p2,
 	float t1 = u1 - u0;
 	float t2 = u2 - u0;
 	float m = t1*b2 - t2*b1;
-	tangent->x = m * (b2 * p01->x - b1 * p02->x);
-	tangent->y = m * (b2 * p01->y - b1 * p02->y);
-	tangent->z = m * (b2 * p01->z - b1 * p02->z);
+	tangent->x = m * (b2 * p01.x - b1 * p02.x);
+	tangent->y = m * (b2 * p01.y - b1 * p02.y);
+	tangent->z = m * (b2 * p01.z - b1 * p02.z);
 	tangent->w = 1;//TODO:考虑放向
 }
 
+//=====================================================================
+// 线程：Win32 线程与 pthread 的最小封装
+//=====================================================================
+typedef void (*thread_proc_t)(void *arg);
+
+#ifdef _WIN32
+typedef struct { HANDLE handle; thread_proc_t proc; void *arg; } thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+static DWORD WINAPI thread_entry(LPVOID param) {
+	thread_t *thread = (thread_t*)param;
+	thread->proc(thread->arg);
+	return 0;
+}
+
+int thread_create(thread_t *thread, thread_proc_t proc, void *arg) {
+	thread->proc = proc;
+	thread->arg = arg;
+	thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+	return (thread->handle != NULL)? 0 : -1;
+}
+
+void thread_join(thread_t *thread) {
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+}
+
+void mutex_init(mutex_t *mutex) { InitializeCriticalSection(mutex); }
+void mutex_destroy(mutex_t *mutex) { DeleteCriticalSection(mutex); }
+void mutex_lock(mutex_t *mutex) { EnterCriticalSection(mutex); }
+void mutex_unlock(mutex_t *mutex) { LeaveCriticalSection(mutex); }
+void cond_init(cond_t *cond) { InitializeConditionVariable(cond); }
+void cond_destroy(cond_t *cond) { (void)cond; }
+void cond_wait(cond_t *cond, mutex_t *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+void cond_signal(cond_t *cond) { WakeConditionVariable(cond); }
+void cond_broadcast(cond_t *cond) { WakeAllConditionVariable(cond); }
+
+// 原子加，返回相加之后的值
+long atomic_add(volatile long *value, long delta) {
+	return InterlockedExchangeAdd(value, delta) + delta;
+}
+
+// 读取带 acquire、写入带 release 语义，MSVC 的 volatile 访问默认如此
+long atomic_load(volatile long *value) { return *value; }
+void atomic_store(volatile long *value, long x) { *value = x; }
+
+// value 等于 expected 时改为 desired，成功返回非 0
+int atomic_cas(volatile long *value, long expected, long desired) {
+	return InterlockedCompareExchange(value, desired, expected) == expected;
+}
+
+// 完整的内存屏障：之前的写入对其他线程可见之后才执行之后的读取
+void atomic_fence(void) { MemoryBarrier(); }
+
+int cpu_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+#else
+typedef struct { pthread_t handle; thread_proc_t proc; void *arg; } thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+static void *thread_entry(void *param) {
+	thread_t *thread = (thread_t*)param;
+	thread->proc(thread->arg);
+	return NULL;
+}
+
+int thread_create(thread_t *thread, thread_proc_t proc, void *arg) {
+	thread->proc = proc;
+	thread->arg = arg;
+	return pthread_create(&thread->handle, NULL, thread_entry, thread);
+}
+
+void thread_join(thread_t *thread) { pthread_join(thread->handle, NULL); }
+
+void mutex_init(mutex_t *mutex) { pthread_mutex_init(mutex, NULL); }
+void mutex_destroy(mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+void mutex_lock(mutex_t *mutex) { pthread_mutex_lock(mutex); }
+void mutex_unlock(mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+void cond_init(cond_t *cond) { pthread_cond_init(cond, NULL); }
+void cond_destroy(cond_t *cond) { pthread_cond_destroy(cond); }
+void cond_wait(cond_t *cond, mutex_t *mutex) { pthread_cond_wait(cond, mutex); }
+void cond_signal(cond_t *cond) { pthread_cond_signal(cond); }
+void cond_broadcast(cond_t *cond) { pthread_cond_broadcast(cond); }
+
+long atomic_add(volatile long *value, long delta) {
+	return __sync_add_and_fetch(value, delta);
+}
+
+long atomic_load(volatile long *value) { return __atomic_load_n(value, __ATOMIC_ACQUIRE); }
+void atomic_store(volatile long *value, long x) { __atomic_store_n(value, x, __ATOMIC_RELEASE); }
+
+int atomic_cas(volatile long *value, long expected, long desired) {
+	return __sync_bool_compare_and_swap(value, expected, desired);
+}
+
+void atomic_fence(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+int cpu_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0)? (int)n : 1;
+}
+#endif
+
+
+//=====================================================================
+// 任务调度：每个线程一个双端队列，自己从底部压入和取出，空闲时从其他
+// 线程队列的顶部窃取。任务处理区间 [begin, end)，执行前把长于 grain 的
+// 区间对半拆开，后一半放入自己的队列，大区间先被窃取，负载不均时自动平衡。
+// 队列是无锁的 Chase-Lev 双端队列：所有者只写 bottom，窃取方用 CAS 推进 top，
+// 只剩一项时所有者也用 CAS 与窃取方竞争
+//=====================================================================
+#define JOB_QUEUE           256		// 每个队列的容量，满了就不再拆分，直接执行
+
+typedef void (*job_proc_t)(void *arg, int begin, int end, int thread);
+
+typedef struct job_s {
+	job_proc_t proc;
+	void *arg;
+	int begin, end;             // 处理 [begin, end)
+	int grain;                  // 区间长于 grain 时拆开
+	volatile long unfinished;   // 尚未完成的区间数，加上还没提交的 1
+	volatile long deps;         // 尚未完成的前驱任务数
+	struct job_s *next;         // 完成后通知的后继任务
+}	job_t;
+
+typedef struct { job_t *job; int begin, end; } job_range_t;
+
+// 队列中为 [top, bottom)，下标按 JOB_QUEUE 取模，一直增加，用无符号差比较；
+// top 和 bottom 由不同线程频繁修改，中间隔开区间数组
+typedef struct {
+	volatile long top;
+	job_range_t ranges[JOB_QUEUE];
+	volatile long bottom;
+}	job_queue_t;
+
+// bottom - top，下标回绕后仍然正确
+#define JOB_QUEUE_SIZE(b, t)    ((long)((unsigned long)(b) - (unsigned long)(t)))
+
+struct sched_s;
+
+typedef struct {
+	struct sched_s *sched;
+	int thread;                 // 线程编号，也是自己队列的下标
+	thread_t handle;
+}	sched_worker_t;
+
+typedef struct sched_s {
+	int threads;                // 线程总数，0 号为提交并等待任务的线程
+	job_queue_t *queues;
+	sched_worker_t *workers;    // 1 .. threads - 1 号线程
+	mutex_t lock;
+	cond_t wake;
+	volatile long queued;       // 所有队列中的区间数
+	volatile long sleeping;     // 等待 wake 的线程数
+	int quit;
+}	sched_t;
+
+void job_init(job_t *job, job_proc_t proc, void *arg, int begin, int end, int grain) {
+	job->proc = proc;
+	job->arg = arg;
+	job->begin = begin;
+	job->end = end;
+	job->grain = (grain > 0)? grain : 1;
+	job->unfinished = 1;
+	job->deps = 0;
+	job->next = NULL;
+}
+
+// job 在 before 完成之后才开始，每个任务只有一个后继
+void job_after(job_t *job, job_t *before) {
+	before->next = job;
+	atomic_add(&job->deps, 1);
+}
+
+// 有线程在等待时唤醒。先原子地修改 queued 或 unfinished 再读 sleeping，
+// 与等待方先增加 sleeping 再检查条件相对，不会丢失唤醒
+static void sched_notify(sched_t *sched, int all) {
+	if (atomic_add(&sched->sleeping, 0) == 0) return;
+	mutex_lock(&sched->lock);
+	if (all) cond_broadcast(&sched->wake);
+	else cond_signal(&sched->wake);
+	mutex_unlock(&sched->lock);
+}
+
+// 只由所有者调用；区间写好之后才以 release 发布新的 bottom
+static int sched_push(sched_t *sched, int thread, job_t *job, int begin, int end) {
+	job_queue_t *queue = &sched->queues[thread];
+	long b = queue->bottom, t = atomic_load(&queue->top);
+	job_range_t *range;
+	if (JOB_QUEUE_SIZE(b, t) >= JOB_QUEUE) return -1;
+	range = &queue->ranges[(unsigned long)b % JOB_QUEUE];
+	range->job = job, range->begin = begin, range->end = end;
+	atomic_store(&queue->bottom, (long)((unsigned long)b + 1));
+	atomic_add(&sched->queued, 1);
+	sched_notify(sched, 0);
+	return 0;
+}
+
+// 所有者从底部取出：先减小 bottom 再读 top，两者之间需要完整的屏障
+static int sched_take(job_queue_t *queue, job_range_t *range) {
+	long b = (long)((unsigned long)queue->bottom - 1), t;
+	int found = 1;
+	atomic_store(&queue->bottom, b);
+	atomic_fence();
+	t = atomic_load(&queue->top);
+	if (JOB_QUEUE_SIZE(b, t) < 0) {
+		atomic_store(&queue->bottom, (long)((unsigned long)b + 1));
+		return 0;
+	}
+	*range = queue->ranges[(unsigned long)b % JOB_QUEUE];
+	if (b == t) {
+		found = atomic_cas(&queue->top, t, (long)((unsigned long)t + 1));
+		atomic_store(&queue->bottom, (long)((unsigned long)t + 1));
+	}
+	return found;
+}
+
+// 其他线程从顶部窃取，CAS 失败说明被别人取走，当作没有
+static int sched_steal(job_queue_t *queue, job_range_t *range) {
+	long t = atomic_load(&queue->top), b;
+	atomic_fence();
+	b = atomic_load(&queue->bottom);
+	if (JOB_QUEUE_SIZE(b, t) <= 0) return 0;
+	*range = queue->ranges[(unsigned long)t % JOB_QUEUE];
+	return atomic_cas(&queue->top, t, (long)((unsigned long)t + 1));
+}
+
+// 先取自己队列底部最近压入的区间，没有时依次从其他队列顶部窃取
+static int sched_pop(sched_t *sched, int thread, job_range_t *range) {
+	int i;
+	for (i = 0; i < sched->threads; i++) {
+		job_queue_t *queue = &sched->queues[(thread + i) % sched->threads];
+		if ((i == 0)? sched_take(queue, range) : sched_steal(queue, range)) {
+			atomic_add(&sched->queued, -1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void sched_submit(sched_t *sched, int thread, job_t *job);
+
+// 完成一个区间；任务的区间全部完成时提交已就绪的后继，并唤醒等待的线程
+static void job_finish(sched_t *sched, int thread, job_t *job) {
+	job_t *next = job->next;	// 计数归零后等待方可能立即释放 job
+	if (atomic_add(&job->unfinished, -1) > 0) return;
+	if (next && atomic_add(&next->deps, -1) == 0) sched_submit(sched, thread, next);
+	sched_notify(sched, 1);
+}
+
+static void sched_execute(sched_t *sched, int thread, const job_range_t *range) {
+	job_t *job = range->job;
+	int begin = range->begin, end = range->end;
+	while (end - begin > job->grain) {
+		int mid = begin + (end - begin) / 2;
+		atomic_add(&job->unfinished, 1);
+		if (sched_push(sched, thread, job, mid, end) != 0) {
+			atomic_add(&job->unfinished, -1);
+			break;
+		}
+		end = mid;
+	}
+	job->proc(job->arg, begin, end, thread);
+	job_finish(sched, thread, job);
+}
+
+// 提交前驱都已完成的任务，由 thread 号线程调用；队列满时直接执行
+void sched_submit(sched_t *sched, int thread, job_t *job) {
+	job_range_t range;
+	if (job->begin >= job->end) {
+		job_finish(sched, thread, job);
+		return;
+	}
+	if (sched_push(sched, thread, job, job->begin, job->end) == 0) return;
+	range.job = job, range.begin = job->begin, range.end = job->end;
+	sched_execute(sched, thread, &range);
+}
+
+// 0 号线程等待 job 完成，期间一起执行队列中的任务
+void sched_wait(sched_t *sched, job_t *job) {
+	job_range_t range;
+	while (atomic_add(&job->unfinished, 0) > 0) {
+		if (sched_pop(sched, 0, &range)) {
+			sched_execute(sched, 0, &range);
+			continue;
+		}
+		mutex_lock(&sched->lock);
+		atomic_add(&sched->sleeping, 1);
+		while (atomic_add(&sched->queued, 0) == 0 && atomic_add(&job->unfinished, 0) > 0) 
+			cond_wait(&sched->wake, &sched->lock);
+		atomic_add(&sched->sleeping, -1);
+		mutex_unlock(&sched->lock);
+	}
+}
+
+static void sched_worker(void *arg) {
+	sched_worker_t *worker = (sched_worker_t*)arg;
+	sched_t *sched = worker->sched;
+	job_range_t range;
+	while (1) {
+		if (sched_pop(sched, worker->thread, &range)) {
+			sched_execute(sched, worker->thread, &range);
+			continue;
+		}
+		mutex_lock(&sched->lock);
+		atomic_add(&sched->sleeping, 1);
+		while (atomic_add(&sched->queued, 0) == 0 && sched->quit == 0) 
+			cond_wait(&sched->wake, &sched->lock);
+		atomic_add(&sched->sleeping, -1);
+		if (sched->quit) break;
+		mutex_unlock(&sched->lock);
+	}
+	mutex_unlock(&sched->lock);
+}
+
+// 启动 threads - 1 个工作线程，线程创建失败时用已有线程继续
+void sched_init(sched_t *sched, int threads) {
+	int i;
+	memset(sched, 0, sizeof(sched_t));
+	sched->threads = (threads > 1)? threads : 1;
+	sched->queues = (job_queue_t*)calloc(sched->threads, sizeof(job_queue_t));
+	sched->workers = (sched_worker_t*)calloc(sched->threads, sizeof(sched_worker_t));
+	assert(sched->queues && sched->workers);
+	mutex_init(&sched->lock);
+	cond_init(&sched->wake);
+	for (i = 1; i < sched->threads; i++) {
+		sched_worker_t *worker = &sched->workers[i - 1];
+		worker->sched = sched;
+		worker->thread = i;
+		if (thread_create(&worker->handle, sched_worker, worker) != 0) {
+			sched->threads = i;
+			break;
+		}
+	}
+}
+
+// 结束工作线程，调用时不能有未完成的任务
+void sched_destroy(sched_t *sched) {
+	int i;
+	mutex_lock(&sched->lock);
+	sched->quit = 1;
+	cond_broadcast(&sched->wake);
+	mutex_unlock(&sched->lock);
+	for (i = 1; i < sched->threads; i++) 
+		thread_join(&sched->workers[i - 1].handle);
+	mutex_destroy(&sched->lock);
+	cond_destroy(&sched->wake);
+	free(sched->queues);
+	free(sched->workers);
+	sched->queues = NULL;
+	sched->workers = NULL;
+}
+
+// 在 0 号线程提交 job 并等待完成
+void sched_run(sched_t *sched, job_t *job) {
+	sched_submit(sched, 0, job);
+	sched_wait(sched, job);
+}
+
+
 //=====================================================================
 // 渲染设备
 //=====================================================================
+#define TILE_SIZE 64		// 分块光栅化的块大小（2 的幂），扫描线也按此步长重新定位
+
+typedef struct { int x0, y0, x1, y1; } rect_t;	// 裁剪矩形 [x0, x1) x [y0, y1)
+
+struct binner_s;
+struct bin_stage_s;
+struct shader_s;
+
+#define MIP_MAX             16		// 纹理金字塔最多层数
+
+// 纹理按 Morton（Z 序）存放，宽高补齐到 2 的幂：texel (x, y) 位于 texels[mx[x] | my[y]]，
+// 相邻的 2x2 纹素通常落在同一条缓存行，沿任意方向遍历纹理的访存都比较集中
+typedef struct {
+	IUINT32 *texels;            // Morton 序的纹理数据
+	const int *mx;              // x 坐标的位交织表
+	const int *my;              // y 坐标的位交织表
+	int width;                  // 纹理宽度
+	int height;                 // 纹理高度
+	float max_u;                // 纹理最大宽度：width - 1
+	float max_v;                // 纹理最大高度：height - 1
+}	miplevel_t;
+
+// 纹理金字塔：由 texture_init 复制生成，之后只读，可以被多个设备、多个线程同时绑定
+typedef struct {
+	miplevel_t mip[MIP_MAX];    // 各级纹理
+	int levels;                 // 纹理金字塔层数
+	char *data;                 // 各层的位交织表和纹理数据
+}	texture_t;
+
 typedef struct {
 	transform_t transform;      // 坐标变换�
 	int width;                  // 窗口宽度
 	int height;                 // 窗口高度
 	IUINT32 **framebuffer;      // 像素缓存：framebuffer[y] 代表�y�
-	float **zbuffer;            // 深度缓存：zbuffer[y] 为第 y行指�
-	IUINT32 **texture;          // 纹理：同样是每行索引
-	int tex_width;              // 纹理宽度
-	int tex_height;             // 纹理高度
-	float max_u;                // 纹理最大宽度：tex_width - 1
-	float max_v;                // 纹理最大高度：tex_height - 1
+	void **zbuffer;             // 深度缓存：zbuffer[y] 为第 y行指�
+	vector_t **gbuffer;         // 延迟着色的法线缓存，w 非 0 表示该像素等待光照
+	rect_t gbuffer_dirty;       // 等待光照的像素范围，x0 >= x1 时为空
+	const texture_t *texture;   // 当前纹理，默认指向 own_texture
+	texture_t own_texture;      // device_set_texture 复制的纹理
+	int sampler;                // 纹理采样方式：SAMPLER_*
 	int render_state;           // 渲染状�
+	int rasterizer;             // 光栅化方式：RASTER_TRAPEZOID / RASTER_HALFSPACE
+	const struct shader_s *shader;  // 自定义着色器，NULL 时按 render_state 使用内置着色器
 	IUINT32 background;         // 背景颜色
 	IUINT32 foreground;         // 线框颜色
 	point_t CameraPos;
+	light_t lights[LIGHT_MAX];  // 光源，默认只有 light_default
+	int light_count;            // 光源数
+	struct binner_s *binner;    // 分块光栅化，NULL 时立即绘制
+	struct bin_stage_s *stage;  // 并行设置图元时的暂存区，非 NULL 时图元先写入这里
+	vertex_post_t *vcache;      // device_draw_indexed 的顶点变换结果
+	int vcache_size;            // vcache 容量
+	float *hiz;                 // Hi-Z：每个 HIZ_TILE 块中最远（最小）的 rhw，只会偏小
+	unsigned char *hiz_dirty;   // 块内写过深度，hiz 需要重新计算
+	unsigned char *hiz_clear;   // 块还没有按清除值填充，首次绘制或 flush 时填充
+	IUINT32 *clear_color;       // 每行的清除颜色
+	int depth_format;           // 深度缓存格式：DEPTH_*
+	int depth_bytes;            // 每像素深度的字节数
+	int hiz_w;                  // Hi-Z 每行块数
+	int hiz_h;                  // Hi-Z 块行数
 }	device_t;
 
+#define HIZ_TILE            8		// Hi-Z 块大小，与半空间光栅化的像素块一致
+
 #define RENDER_STATE_WIREFRAME      1		// 渲染线框
 #define RENDER_STATE_TEXTURE        2		// 渲染纹理
 #define RENDER_STATE_COLOR          4		// 渲染颜色
+#define RENDER_STATE_DEFERRED       8		// 延迟着色：光栅化只写 albedo 和法线，flush 时统一光照
+#define RENDER_STATE_DEPTH          16		// 只写深度，不着色：用于阴影图、遮挡测试
+#define RENDER_STATE_ZPREPASS       32		// Z-prepass：flush 时每块先只画深度，再对深度相等的像素着色，
+											// 每个像素只着色一次；需要分块记录图元，先用 device_set_threads 开启分块模式，
+											// 立即模式下忽略
+
+#define SAMPLER_BILINEAR    0		// 只读 0 级纹理，双线性过滤
+#define SAMPLER_MIP         1		// 选择最接近的 mip 级别，双线性过滤
+#define SAMPLER_TRILINEAR   2		// 相邻两级 mip 双线性过滤后再插值
+
+#define RASTER_TRAPEZOID    0		// 拆分梯形，逐扫描线插值
+#define RASTER_HALFSPACE    1		// 边函数，按像素块 SIMD 测试
+
+// 32 位浮点，直接存放 rhw = 1 / w。rhw 近处大、远处趋于 0，本身就是远平面在无穷远的
+// reversed-Z 浮点格式：浮点数在 0 附近最密，正好补偿透视造成的远处深度压缩。
+// 再换算成 1 - z / w 只会多一次舍入，并在远平面附近相减损失精度，所以不单独提供
+#define DEPTH_FLOAT         0
+#define DEPTH_UNORM16       1		// 16 位定点 reversed-Z
+#define DEPTH_UNORM24       2		// 24 位定点 reversed-Z，每像素 3 字节紧凑存放
+#define DEPTH_FORMATS       3
+
+// 各深度格式的存储类型、读写和由 rhw 编码的方法，光栅化内层循环按格式展开。
+// 深度都随 rhw 单调增加，测试都是 >=，清除值都是全 0；定点格式存放 reversed-Z，
+// 它是 rhw 的仿射函数 1 - z / w = (1 - m22) - m32 * rhw（m 为投影矩阵），即 rhw * scale + bias
+#define DEPTH_TYPE_FLOAT                    float
+#define DEPTH_LOAD_FLOAT(row, x)            (((const float*)(row))[x])
+#define DEPTH_STORE_FLOAT(row, x, d)        (((float*)(row))[x] = (d))
+#define DEPTH_ENCODE_FLOAT(rhw, scale, bias)    (rhw)
+
+#define DEPTH_TYPE_UNORM16                  IUINT32
+#define DEPTH_LOAD_UNORM16(row, x)          ((IUINT32)((const unsigned short*)(row))[x])
+#define DEPTH_STORE_UNORM16(row, x, d)      (((unsigned short*)(row))[x] = (unsigned short)(d))
+#define DEPTH_ENCODE_UNORM16(rhw, scale, bias)  depth_unorm((rhw) * (scale) + (bias), 65535.0f)
+
+#define DEPTH_TYPE_UNORM24                  IUINT32
+#define DEPTH_LOAD_UNORM24(row, x)          ((IUINT32)((const unsigned char*)(row))[(x) * 3] | \
+	((IUINT32)((const unsigned char*)(row))[(x) * 3 + 1] << 8) | \
+	((IUINT32)((const unsigned char*)(row))[(x) * 3 + 2] << 16))
+#define DEPTH_STORE_UNORM24(row, x, d)      do { \
+		unsigned char *p_ = (unsigned char*)(row) + (x) * 3; \
+		p_[0] = (unsigned char)(d); \
+		p_[1] = (unsigned char)((d) >> 8); \
+		p_[2] = (unsigned char)((d) >> 16); \
+	}	while (0)
+#define DEPTH_ENCODE_UNORM24(rhw, scale, bias)  depth_unorm((rhw) * (scale) + (bias), 16777215.0f)
+
+// 按 DEPTH_* 的顺序排列的各格式实现 name_float, name_unorm16, name_unorm24
+#define DEPTH_TABLE(name) { name##_float, name##_unorm16, name##_unorm24 }
+
+// reversed-Z 的仿射系数，由投影矩阵得到
+#define DEPTH_SCALE(device)     (-(device)->transform.projection.m[3][2])
+#define DEPTH_BIAS(device)      (1.0f - (device)->transform.projection.m[2][2])
+
+// [0, 1] 量化为 [0, max] 的定点数，截断取整
+static IUINT32 depth_unorm(float d, float max) {
+	if (d <= 0.0f) return 0;
+	if (d >= 1.0f) return (IUINT32)max;
+	return (IUINT32)(d * max);
+}
+
+void device_set_threads(device_t *device, int threads);
+void device_flush(device_t *device);
+void device_set_texture(device_t *device, void *bits, long pitch, int w, int h);
+void texture_destroy(texture_t *texture);
+
+static const int depth_format_bytes[DEPTH_FORMATS] = { 4, 2, 3 };
 
 // 设备初始化，fb为外部帧缓存，非 NULL 将引用外部帧缓存（每�4字节对齐�
-void device_init(device_t *device, int width, int height, void *fb) {
-	int need = sizeof(void*) * (height * 2 + 1024) + width * height * 8;
+// 深度缓存格式由 depth_format 指定，和帧缓存在同一次分配中
+void device_init_depth(device_t *device, int width, int height, void *fb, int depth_format) {
+	int bytes = depth_format_bytes[depth_format];
+	int need = sizeof(void*) * height * 2 + width * height * (4 + bytes) + 16;
 	char *ptr = (char*)malloc(need + 64);
 	char *framebuf, *zbuf;
 	int j;
 	assert(ptr);
 	device->framebuffer = (IUINT32**)ptr;
-	device->zbuffer = (float**)(ptr + sizeof(void*) * height);
+	device->zbuffer = (void**)(ptr + sizeof(void*) * height);
 	ptr += sizeof(void*) * height * 2;
-	device->texture = (IUINT32**)ptr;
-	ptr += sizeof(void*) * 1024;
 	framebuf = (char*)ptr;
 	zbuf = (char*)ptr + width * height * 4;
-	ptr += width * height * 8;
+	ptr += width * height * (4 + bytes);
 	if (fb != NULL) framebuf = (char*)fb;
 	for (j = 0; j < height; j++) {
 		device->framebuffer[j] = (IUINT32*)(framebuf + width * 4 * j);
-		device->zbuffer[j] = (float*)(zbuf + width * 4 * j);
-	}
-	device->texture[0] = (IUINT32*)ptr;
-	device->texture[1] = (IUINT32*)(ptr + 16);
-	memset(device->texture[0], 0, 64);
-	device->tex_width = 2;
-	device->tex_height = 2;
-	device->max_u = 1.0f;
-	device->max_v = 1.0f;
+		device->zbuffer[j] = zbuf + width * bytes * j;
+	}
+	device->depth_format = depth_format;
+	device->depth_bytes = bytes;
 	device->width = width;
 	device->height = height;
 	device->background = 0xc0c0c0;
 	device->foreground = 0;
 	transform_init(&device->transform, width, height);
 	device->render_state = RENDER_STATE_WIREFRAME;
+	device->rasterizer = RASTER_TRAPEZOID;
+	device->shader = NULL;
+	device->gbuffer = NULL;
+	device->gbuffer_dirty.x0 = device->gbuffer_dirty.x1 = 0;
+	device->gbuffer_dirty.y0 = device->gbuffer_dirty.y1 = 0;
+	device->binner = NULL;
+	device->stage = NULL;
+	device->own_texture.data = NULL;
+	device->own_texture.levels = 0;
+	device->lights[0] = light_default;
+	device->light_count = 1;
+	device->vcache = NULL;
+	device->vcache_size = 0;
+	device->hiz_w = (width + HIZ_TILE - 1) / HIZ_TILE;
+	device->hiz_h = (height + HIZ_TILE - 1) / HIZ_TILE;
+	device->hiz = (float*)malloc((sizeof(float) + 2) * device->hiz_w * device->hiz_h);
+	device->clear_color = (IUINT32*)malloc(sizeof(IUINT32) * height);
+	assert(device->hiz && device->clear_color);
+	device->hiz_dirty = (unsigned char*)(device->hiz + device->hiz_w * device->hiz_h);
+	device->hiz_clear = device->hiz_dirty + device->hiz_w * device->hiz_h;
+	memset(device->hiz, 0, (sizeof(float) + 2) * device->hiz_w * device->hiz_h);
+	device->sampler = SAMPLER_TRILINEAR;
+	ptr = (char*)(((size_t)ptr + 15) & ~(size_t)15);	// 2、3 字节深度之后不一定对齐，分配时留有余量
+	memset(ptr, 0, 16);
+	device_set_texture(device, ptr, 8, 2, 2);	// 默认 2x2 黑色纹理
+}
+
+// 使用 32 位浮点深度缓存初始化设备
+void device_init(device_t *device, int width, int height, void *fb) {
+	device_init_depth(device, width, height, fb, DEPTH_FLOAT);
+}
+
+// 切换帧缓存，fb 为 NULL 时使用设备自己的缓存；先完成已提交的绘制，
+// 新帧缓存的内容保持不变，一般紧接着 device_clear
+void device_set_framebuffer(device_t *device, void *fb) {
+	char *framebuf = (char*)(device->zbuffer + device->height);
+	int j;
+	device_flush(device);
+	if (fb != NULL) framebuf = (char*)fb;
+	for (j = 0; j < device->height; j++) 
+		device->framebuffer[j] = (IUINT32*)(framebuf + device->width * 4 * j);
 }
 
 // 删除设备
 void device_destroy(device_t *device) {
+	device_set_threads(device, 0);
+	if (device->gbuffer)
+		free(device->gbuffer);
+	texture_destroy(&device->own_texture);
+	if (device->vcache)
+		free(device->vcache);
+	if (device->hiz)
+		free(device->hiz);
+	if (device->clear_color)
+		free(device->clear_color);
 	if (device->framebuffer) 
 		free(device->framebuffer);
+	device->gbuffer = NULL;
 	device->framebuffer = NULL;
 	device->zbuffer = NULL;
 	device->texture = NULL;
+	device->vcache = NULL;
+	device->vcache_size = 0;
+	device->hiz = NULL;
+	device->hiz_dirty = NULL;
+	device->hiz_clear = NULL;
+	device->clear_color = NULL;
 }
 
-// 设置当前纹理
-void device_set_texture(device_t *device, void *bits, long pitch, int w, int h) {
-	char *ptr = (char*)bits;
+// 分配延迟着色用的法线缓存，初次使用 RENDER_STATE_DEFERRED 时调用
+void device_gbuffer_init(device_t *device) {
+	char *ptr;
 	int j;
-	assert(w <= 1024 && h <= 1024);
-	for (j = 0; j < h; ptr += pitch, j++) 	// 重新计算每行纹理的指�
-		device->texture[j] = (IUINT32*)ptr;
-	device->tex_width = w;
-	device->tex_height = h;
-	device->max_u = (float)(w - 1);
-	device->max_v = (float)(h - 1);
+	if (device->gbuffer) return;
+	ptr = (char*)malloc(sizeof(void*) * device->height + sizeof(vector_t) * device->width * device->height);
+	assert(ptr);
+	device->gbuffer = (vector_t**)ptr;
+	ptr += sizeof(void*) * device->height;
+	memset(ptr, 0, sizeof(vector_t) * device->width * device->height);
+	for (j = 0; j < device->height; j++) 
+		device->gbuffer[j] = (vector_t*)(ptr + sizeof(vector_t) * device->width * j);
 }
 
-// 清空 framebuffer �zbuffer
+// 生成 Morton 位交织表：坐标的低 shared 位放在 2i + odd 位，其余位放在交织部分之上
+static void morton_table(int *table, int size, int shared, int odd) {
+	int i, b;
+	for (i = 0; i < size; i++) {
+		int m = 0;
+		for (b = 0; (1 << b) < size; b++) {
+			if (((i >> b) & 1) == 0) continue;
+			m |= (b < shared)? (1 << (b * 2 + odd)) : (1 << (shared + b));
+		}
+		table[i] = m;
+	}
+}
+
+// 2 的幂中不小于 x 的最小值
+static int pow2_ceil(int x) {
+	int n = 1;
+	while (n < x) n <<= 1;
+	return n;
+}
+
+// 由 bits 生成纹理金字塔，纹理被复制成 Morton 序，调用后 bits 可以释放；
+// 1 级以上每层由上一层 2x2 平均得到
+void texture_init(texture_t *texture, const void *bits, long pitch, int w, int h) {
+	int levels, tables, texels, j, k;
+	char *ptr;
+	for (levels = 0, tables = 0, texels = 0, j = w, k = h; ; levels++) {
+		tables += pow2_ceil(j) + pow2_ceil(k);
+		texels += pow2_ceil(j) * pow2_ceil(k);
+		if (j == 1 && k == 1) break;
+		j = (j > 1)? j / 2 : 1;
+		k = (k > 1)? k / 2 : 1;
+	}
+	levels++;
+	assert(levels <= MIP_MAX);
+	texture->data = (char*)malloc(sizeof(IUINT32) * texels + sizeof(int) * tables);
+	assert(texture->data);
+	texture->levels = levels;
+	ptr = texture->data;
+	for (k = 0; k < levels; k++) {
+		miplevel_t *level = &texture->mip[k];
+		int pw = pow2_ceil(w), ph = pow2_ceil(h), shared;
+		int *mx, *my, x, y, i;
+		for (shared = 0; (2 << shared) <= min(pw, ph); shared++);
+		level->texels = (IUINT32*)ptr;
+		ptr += sizeof(IUINT32) * pw * ph;
+		mx = (int*)ptr, ptr += sizeof(int) * pw;
+		my = (int*)ptr, ptr += sizeof(int) * ph;
+		morton_table(mx, pw, shared, 0);
+		morton_table(my, ph, shared, 1);
+		level->mx = mx;
+		level->my = my;
+		level->width = w;
+		level->height = h;
+		level->max_u = (float)(w - 1);
+		level->max_v = (float)(h - 1);
+		for (y = 0; y < h; y++) {
+			if (k == 0) {
+				const IUINT32 *src = (const IUINT32*)((const char*)bits + pitch * y);
+				for (x = 0; x < w; x++) 
+					level->texels[mx[x] | my[y]] = src[x];
+				continue;
+			}
+			for (x = 0; x < w; x++) {
+				const miplevel_t *src = &texture->mip[k - 1];
+				int x0 = src->mx[min(x * 2, src->width - 1)], x1 = src->mx[min(x * 2 + 1, src->width - 1)];
+				int y0 = src->my[min(y * 2, src->height - 1)], y1 = src->my[min(y * 2 + 1, src->height - 1)];
+				IUINT32 c00 = src->texels[x0 | y0], c01 = src->texels[x1 | y0];
+				IUINT32 c10 = src->texels[x0 | y1], c11 = src->texels[x1 | y1];
+				IUINT32 c = 0;
+				for (i = 0; i < 24; i += 8) {
+					IUINT32 sum = ((c00 >> i) & 0xff) + ((c01 >> i) & 0xff) + 
+						((c10 >> i) & 0xff) + ((c11 >> i) & 0xff);
+					c |= ((sum + 2) >> 2) << i;
+				}
+				level->texels[mx[x] | my[y]] = c;
+			}
+		}
+		w = (w > 1)? w / 2 : 1;
+		h = (h > 1)? h / 2 : 1;
+	}
+}
+
+void texture_destroy(texture_t *texture) {
+	if (texture->data) free(texture->data);
+	texture->data = NULL;
+	texture->levels = 0;
+}
+
+// 复制 bits 作为设备自己的纹理并绑定
+void device_set_texture(device_t *device, void *bits, long pitch, int w, int h) {
+	device_flush(device);	// 已分块的图元仍引用旧纹理
+	texture_destroy(&device->own_texture);
+	texture_init(&device->own_texture, bits, pitch, w, h);
+	device->texture = &device->own_texture;
+}
+
+// 绑定外部纹理，NULL 恢复设备自己的纹理；不复制也不 flush，
+// 纹理要保持有效直到使用它的图元 flush 完成
+void device_bind_texture(device_t *device, const texture_t *texture) {
+	device->texture = (texture != NULL)? texture : &device->own_texture;
+}
+
+// 增加一个光源，返回下标，满了返回 -1；device->light_count = 0 清除全部光源
+int device_add_light(device_t *device, const light_t *light) {
+	if (device->light_count >= LIGHT_MAX) return -1;
+	device->lights[device->light_count] = *light;
+	return device->light_count++;
+}
+
+// 用清除值填充 [x0, x1) x [y0, y1)；stream 非 0 时整条缓存行用不经过缓存的 SSE2 写入，
+// 用于之后不会马上读取的区域。不足一行的部分写入会使写合并缓冲区退化，仍用普通写入
+static void device_clear_fill(device_t *device, int x0, int x1, int y0, int y1, int stream) {
+	int bytes = device->depth_bytes;
+	int x, y;
+	for (y = y0; y < y1; y++) {
+		IUINT32 *dst = device->framebuffer[y], cc = device->clear_color[y];
+		char *zbuffer = (char*)device->zbuffer[y] + x0 * bytes;
+		int zsize = (x1 - x0) * bytes;
+		x = x0;
+#ifdef MINI3D_SSE2
+		if (stream) {
+			__m128i c4 = _mm_set1_epi32((int)cc);
+			__m128i z4 = _mm_setzero_si128();
+			int i, start = x;
+			while (start < x1 && ((size_t)(dst + start) & 63)) start++;
+			for (i = x; i < start; i++) dst[i] = cc;
+			for (x = start; x + 16 <= x1; x += 16) {
+				for (i = 0; i < 16; i += 4) 
+					_mm_stream_si128((__m128i*)(dst + x + i), c4);
+			}
+			for (start = 0; start < zsize && ((size_t)(zbuffer + start) & 63); start++) 
+				zbuffer[start] = 0;
+			for (i = start; i + 64 <= zsize; i += 64) {
+				_mm_stream_si128((__m128i*)(zbuffer + i), z4);
+				_mm_stream_si128((__m128i*)(zbuffer + i + 16), z4);
+				_mm_stream_si128((__m128i*)(zbuffer + i + 32), z4);
+				_mm_stream_si128((__m128i*)(zbuffer + i + 48), z4);
+			}
+			zbuffer += i, zsize -= i;
+		}
+#endif
+		for (; x < x1; x++) dst[x] = cc;	// 分开写颜色和深度，两个数组可能别名时编译器也能向量化
+		memset(zbuffer, 0, zsize);
+	}
+#ifdef MINI3D_SSE2
+	if (stream) _mm_sfence();
+#endif
+}
+
+// 第一次绘制块 (tx, ty) 之前按清除值填充
+void device_clear_tile(device_t *device, int tx, int ty) {
+	int x0 = tx * HIZ_TILE, y0 = ty * HIZ_TILE;
+	device_clear_fill(device, x0, min(x0 + HIZ_TILE, device->width), 
+		y0, min(y0 + HIZ_TILE, device->height), 0);
+	device->hiz_clear[ty * device->hiz_w + tx] = 0;
+}
+
+#define device_clear_check(device, tx, ty) \
+	if ((device)->hiz_clear[(ty) * (device)->hiz_w + (tx)]) device_clear_tile(device, tx, ty)
+
+// 填充 clip 内所有没有被绘制过的块，每行连续的块合并成一段写入
+void device_clear_resolve(device_t *device, const rect_t *clip) {
+	int tx0 = clip->x0 / HIZ_TILE, tx1 = (clip->x1 + HIZ_TILE - 1) / HIZ_TILE;
+	int ty0 = clip->y0 / HIZ_TILE, ty1 = (clip->y1 + HIZ_TILE - 1) / HIZ_TILE;
+	int tx, ty, start;
+	for (ty = ty0; ty < ty1; ty++) {
+		unsigned char *pending = device->hiz_clear + ty * device->hiz_w;
+		for (tx = tx0; tx < tx1; ) {
+			if (pending[tx] == 0) { tx++; continue; }
+			for (start = tx; tx < tx1 && pending[tx]; tx++) pending[tx] = 0;
+			device_clear_fill(device, start * HIZ_TILE, min(tx * HIZ_TILE, device->width), 
+				ty * HIZ_TILE, min((ty + 1) * HIZ_TILE, device->height), 1);
+		}
+	}
+}
+
+// 清空 framebuffer 和 zbuffer：只记录每行的清除颜色并标记所有块待清除，
+// 块在第一次绘制时或 device_flush 时才填充，flush 之后帧缓存内容才完整
 void device_clear(device_t *device, int mode) {
-	int y, x, height = device->height;
+	int y, height = device->height;
+	int count = device->hiz_w * device->hiz_h;
+	device_flush(device);
 	for (y = 0; y < device->height; y++) {
-		IUINT32 *dst = device->framebuffer[y];
-		IUINT32 cc = (height - 1 - y) * 230 / (height - 1);
+		IUINT32 cc = (height > 1)? (height - 1 - y) * 230 / (height - 1) : 230;
 		cc = (cc << 16) | (cc << 8) | cc;
 		if (mode == 0) cc = device->background;
-		for (x = device->width; x > 0; dst++, x--) dst[0] = cc;
+		device->clear_color[y] = cc;
 	}
-	for (y = 0; y < device->height; y++) {
-		float *dst = device->zbuffer[y];
-		for (x = device->width; x > 0; dst++, x--) dst[0] = 0.0f;
+	memset(device->hiz, 0, (sizeof(float) + 1) * count);
+	memset(device->hiz_clear, 1, count);
+}
+
+// 块 (tx, ty) 中最远的深度，块内写过深度时重新计算
+float device_hiz_get(device_t *device, int tx, int ty) {
+	int index = ty * device->hiz_w + tx;
+	if (device->hiz_dirty[index]) {
+		int x0 = tx * HIZ_TILE, x1 = min(x0 + HIZ_TILE, device->width);
+		int y0 = ty * HIZ_TILE, y1 = min(y0 + HIZ_TILE, device->height);
+		int x, y;
+		#define HIZ_MIN(T, LOAD) { \
+			T z = LOAD(device->zbuffer[y0], x0); \
+			for (y = y0; y < y1; y++) { \
+				const void *row = device->zbuffer[y]; \
+				for (x = x0; x < x1; x++) z = (LOAD(row, x) < z)? LOAD(row, x) : z; \
+			} \
+			d = (float)z; \
+		}
+		float d = 0.0f;
+		switch (device->depth_format) {
+		case DEPTH_FLOAT: HIZ_MIN(float, DEPTH_LOAD_FLOAT); break;
+		case DEPTH_UNORM16: HIZ_MIN(IUINT32, DEPTH_LOAD_UNORM16); d /= 65535.0f; break;
+		case DEPTH_UNORM24: HIZ_MIN(IUINT32, DEPTH_LOAD_UNORM24); d /= 16777215.0f; break;
+		}
+		#undef HIZ_MIN
+		if (device->depth_format != DEPTH_FLOAT && d > 0.0f) {
+			// 换算成 rhw，再留出编码时舍入误差的余量，保证只会偏小
+			d = (d - DEPTH_BIAS(device)) / DEPTH_SCALE(device);
+			d -= d * 1e-4f + 1e-6f;
+		}
+		device->hiz[index] = max(d, 0.0f);
+		device->hiz_dirty[index] = 0;
+	}
+	return device->hiz[index];
+}
+
+// 读取像素 (x, y) 的深度并换算成 rhw
+float device_depth_rhw(const device_t *device, int x, int y) {
+	const void *row = device->zbuffer[y];
+	float d;
+	switch (device->depth_format) {
+	case DEPTH_UNORM16: d = (float)DEPTH_LOAD_UNORM16(row, x) / 65535.0f; break;
+	case DEPTH_UNORM24: d = (float)DEPTH_LOAD_UNORM24(row, x) / 16777215.0f; break;
+	default: return DEPTH_LOAD_FLOAT(row, x);
+	}
+	return (d - DEPTH_BIAS(device)) / DEPTH_SCALE(device);
+}
+
+// 即将读写第 y 行 [x0, x1)：填充还没清除的块，并标记写过深度
+void device_hiz_touch(device_t *device, int x0, int x1, int y) {
+	int ty = y / HIZ_TILE;
+	unsigned char *dirty = device->hiz_dirty + ty * device->hiz_w;
+	int tx;
+	for (tx = x0 / HIZ_TILE; tx <= (x1 - 1) / HIZ_TILE; tx++) {
+		device_clear_check(device, tx, ty);
+		dirty[tx] = 1;
+	}
+}
+
+// 矩形 [x0, x1) x [y0, y1) 内深度都比 zmax 近时返回 1：rhw 不超过 zmax 的图元在其中整个被遮挡。
+// 分块渲染时只能查询本线程负责的分块
+int device_hiz_occluded(device_t *device, int x0, int y0, int x1, int y1, float zmax) {
+	int tx, ty;
+	x0 = max(x0, 0), y0 = max(y0, 0);
+	x1 = min(x1, device->width), y1 = min(y1, device->height);
+	if (x0 >= x1 || y0 >= y1) return 1;
+	for (ty = y0 / HIZ_TILE; ty <= (y1 - 1) / HIZ_TILE; ty++) {
+		for (tx = x0 / HIZ_TILE; tx <= (x1 - 1) / HIZ_TILE; tx++) {
+			if (device->stage && device->hiz_dirty[ty * device->hiz_w + tx]) return 0;	// 并行设置时不更新 Hi-Z
+			if (device_hiz_get(device, tx, ty) <= zmax) return 0;
+		}
 	}
+	return 1;
 }
 
 // 画点
 void device_pixel(device_t *device, int x, int y, IUINT32 color) {
 	if (((IUINT32)x) < (IUINT32)device->width && ((IUINT32)y) < (IUINT32)device->height) {
+		device_clear_check(device, x / HIZ_TILE, y / HIZ_TILE);
 		device->framebuffer[y][x] = color;
 	}
 }
 
-// 绘制线段
-void device_draw_line(device_t *device, int x1, int y1, int x2, int y2, IUINT32 c) {
+// 画点，只写入裁剪矩形内的像素
+static void device_pixel_clip(device_t *device, int x, int y, IUINT32 color, const rect_t *clip) {
+	if (x >= clip->x0 && x < clip->x1 && y >= clip->y0 && y < clip->y1) {
+		device_clear_check(device, x / HIZ_TILE, y / HIZ_TILE);
+		device->framebuffer[y][x] = color;
+		if (device->gbuffer) device->gbuffer[y][x].w = 0.0f;	// 线框不参与延迟光照
+	}
+}
+
+// 绘制线段，裁剪到 clip 矩形（clip 不超出屏幕）
+void device_draw_line_clip(device_t *device, int x1, int y1, int x2, int y2, IUINT32 c, const rect_t *clip) {
 	int x, y, rem = 0;
 	if (x1 == x2 && y1 == y2) {
-		device_pixel(device, x1, y1, c);
+		device_pixel_clip(device, x1, y1, c, clip);
 	}	else if (x1 == x2) {
 		int inc = (y1 <= y2)? 1 : -1;
-		for (y = y1; y != y2; y += inc) device_pixel(device, x1, y, c);
-		device_pixel(device, x2, y2, c);
+		for (y = y1; y != y2; y += inc) device_pixel_clip(device, x1, y, c, clip);
+		device_pixel_clip(device, x2, y2, c, clip);
 	}	else if (y1 == y2) {
 		int inc = (x1 <= x2)? 1 : -1;
-		for (x = x1; x != x2; x += inc) device_pixel(device, x, y1, c);
-		device_pixel(device, x2, y2, c);
+		for (x = x1; x != x2; x += inc) device_pixel_clip(device, x, y1, c, clip);
+		device_pixel_clip(device, x2, y2, c, clip);
 	}	else {
 		int dx = (x1 < x2)? x2 - x1 : x1 - x2;
 		int dy = (y1 < y2)? y2 - y1 : y1 - y2;
 		if (dx >= dy) {
 			if (x2 < x1) x = x1, y = y1, x1 = x2, y1 = y2, x2 = x, y2 = y;
 			for (x = x1, y = y1; x <= x2; x++) {
-				device_pixel(device, x, y, c);
+				device_pixel_clip(device, x, y, c, clip);
 				rem += dy;
 				if (rem >= dx) {
 					rem -= dx;
 					y += (y2 >= y1)? 1 : -1;
-					device_pixel(device, x, y, c);
+					device_pixel_clip(device, x, y, c, clip);
 				}
 			}
-			device_pixel(device, x2, y2, c);
+			device_pixel_clip(device, x2, y2, c, clip);
 		}	else {
 			if (y2 < y1) x = x1, y = y1, x1 = x2, y1 = y2, x2 = x, y2 = y;
 			for (x = x1, y = y1; y <= y2; y++) {
-				device_pixel(device, x, y, c);
+				device_pixel_clip(device, x, y, c, clip);
 				rem += dx;
 				if (rem >= dy) {
 					rem -= dy;
 					x += (x2 >= x1)? 1 : -1;
-					device_pixel(device, x, y, c);
+					device_pixel_clip(device, x, y, c, clip);
 				}
 			}
-			device_pixel(device, x2, y2, c);
+			device_pixel_clip(device, x2, y2, c, clip);
 		}
 	}
 }
 
+// 绘制线段
+void device_draw_line(device_t *device, int x1, int y1, int x2, int y2, IUINT32 c) {
+	rect_t clip = { 0, 0, device->width, device->height };
+	device_draw_line_clip(device, x1, y1, x2, y2, c, &clip);
+}
+
 void giveRgb(IUINT32 color, int* r, int* g, int* b)
 {
 	int rMask = 0xFF << 16;
@@ -819,47 +1996,65 @@ void giveRgb(IUINT32 color, int* r, int* g, int* b)
 	*b = bMask & (int)color;
 }
 
-// 根据坐标读取纹理
+// 在一级纹理上双线性采样，权重取 8 位定点（与旧版浮点 lerp 相比低位可能差 1）
+// 注意：旧版按 texture[u][v] 取样，u/v 被转置；这里按 u 取列、v 取行
+static IUINT32 texture_bilinear(const miplevel_t *level, float u, float v) {
+	float fu = u * level->max_u, fv = v * level->max_v;
+	float x = (float)floor(fu), y = (float)floor(fv);
+	int wx = (int)((fu - x) * 256.0f), wy = (int)((fv - y) * 256.0f);
+	int x0 = CMID((int)x, 0, level->width - 1), y0 = CMID((int)y, 0, level->height - 1);
+	int x1 = min(x0 + 1, level->width - 1), y1 = min(y0 + 1, level->height - 1);
+	const IUINT32 *t = level->texels;
+	int mx0 = level->mx[x0], mx1 = level->mx[x1], my0 = level->my[y0], my1 = level->my[y1];
+	IUINT32 c00 = t[mx0 | my0], c01 = t[mx1 | my0], c10 = t[mx0 | my1], c11 = t[mx1 | my1];
+	IUINT32 c = 0;
+	int i;
+	for (i = 0; i < 24; i += 8) {
+		int a = (c00 >> i) & 0xff, b = (c01 >> i) & 0xff;
+		int d = (c10 >> i) & 0xff, e = (c11 >> i) & 0xff;
+		int top = (a << 8) + (b - a) * wx;
+		int bottom = (d << 8) + (e - d) * wx;
+		c |= (IUINT32)(((top << 8) + (bottom - top) * wy) >> 16) << i;
+	}
+	return c;
+}
+
+// 根据坐标读取 0 级纹理
 IUINT32 device_texture_read(const device_t *device, float u, float v) {
-	int x, y;
-	u = u * device->max_u;
-	v = v * device->max_v;
-	//双线性插�
-	float r1 = u - floor(u);
-	float r2 = v - floor(v);
-	IUINT32 c00, c01, c10, c11;
-	int uMax = device->tex_width - 1;
-	int vMax = device->tex_height - 1;
-	c00 = device->texture[CMID(u, 0, uMax)][CMID(v, 0, vMax)];
-	c01 = device->texture[CMID(u + 1, 0, uMax)][CMID(v, 0, vMax)];
-	c10 = device->texture[CMID(u, 0, uMax)][CMID(v + 1, 0, vMax)];
-	c11 = device->texture[CMID(u + 1, 0, uMax)][CMID(v + 1, 0, vMax)];
-	int c00r, c00g, c00b;
-	int c01r, c01g, c01b;
-	int c10r, c10g, c10b;
-	int c11r, c11g, c11b;
-	giveRgb(c00, &c00r, &c00g, &c00b);
-	giveRgb(c01, &c01r, &c01g, &c01b);
-	giveRgb(c10, &c10r, &c10g, &c10b);
-	giveRgb(c11, &c11r, &c11g, &c11b);
-	int lerpR, lerpG, lerpB = 0;
-	lerpR = lerpColor(
-		lerpColor(c00r, c01r, r1),
-		lerpColor(c10r, c11r, r1), r2);
-	lerpG = lerpColor(
-		lerpColor(c00g, c01g, r1),
-		lerpColor(c10g, c11g, r1), r2);
-	lerpB = lerpColor(
-		lerpColor(c00b, c01b, r1),
-		lerpColor(c10b, c11b, r1), r2);
-	return lerpR << 16 | lerpG << 8 | lerpB;
+	return texture_bilinear(&device->texture->mip[0], u, v);
+}
 
-	
-	x = (int)(u + 0.5f);
-	y = (int)(v + 0.5f);
-	x = CMID(x, 0, device->tex_width - 1);
-	y = CMID(y, 0, device->tex_height - 1);
-	return device->texture[y][x];
+// 按纹理坐标在屏幕空间的导数选择 mip 级别采样
+IUINT32 device_texture_sample(const device_t *device, float u, float v, 
+	const texcoord_t *ddx, const texcoord_t *ddy) {
+	const texture_t *texture = device->texture;
+	const miplevel_t *base = &texture->mip[0];
+	float ux, vx, uy, vy, rho, lod;
+	int level;
+	if (device->sampler == SAMPLER_BILINEAR || texture->levels <= 1) 
+		return texture_bilinear(base, u, v);
+	ux = ddx->u * base->max_u, vx = ddx->v * base->max_v;
+	uy = ddy->u * base->max_u, vy = ddy->v * base->max_v;
+	rho = max(ux * ux + vx * vx, uy * uy + vy * vy);
+	if (rho <= 1.0f) return texture_bilinear(base, u, v);	// 放大
+	lod = (float)log(rho) * 0.7213475f;		// log2(sqrt(rho))
+	if (lod >= (float)(texture->levels - 1)) 
+		return texture_bilinear(&texture->mip[texture->levels - 1], u, v);
+	if (device->sampler == SAMPLER_MIP) 
+		return texture_bilinear(&texture->mip[(int)(lod + 0.5f)], u, v);
+	level = (int)lod;
+	{
+		IUINT32 c0 = texture_bilinear(&texture->mip[level], u, v);
+		IUINT32 c1 = texture_bilinear(&texture->mip[level + 1], u, v);
+		int t = (int)((lod - (float)level) * 256.0f);
+		IUINT32 c = 0;
+		int i;
+		for (i = 0; i < 24; i += 8) {
+			int a = (c0 >> i) & 0xff, b = (c1 >> i) & 0xff;
+			c |= (IUINT32)(((a << 8) + (b - a) * t) >> 8) << i;
+		}
+		return c;
+	}
 }
 
 int color2int(const color_t col)
@@ -910,38 +2105,34 @@ int color_add(int col1, int col2)
 	return (r << 16) | (g << 8) | b;
 }
 
-int blinPhong(const vertex_t *vertex, const light_t* light, const device_t* device, int albedo)
+// wPos 为世界坐标，normal 为单位化的世界空间法线
+int blinPhong(const point_t *wPos, const vector_t *normal, const light_t* light, const device_t* device, int albedo)
 {
-	vector_t wPos;
 	vector_t lDir;
 	vector_t vDir;
-	transform_homogenize_reverse(&wPos, &vertex->pos, device->width, device->height);
-	matrix_apply(&wPos, &wPos, &device->transform.vp_reverse);
 	vector_t half;
-	vector_sub(&lDir, &light->position, &wPos);
+	vector_sub(&lDir, &light->position, wPos);
 	float dist2Light = sqrt(vector_dotproduct(&lDir, &lDir));
-	point_t x = device->CameraPos; 
-	vector_t y = device->CameraPos;
-	vector_sub(&vDir, &device->CameraPos, &wPos);
+	vector_sub(&vDir, &device->CameraPos, wPos);
 	vector_normalize(&lDir);
 	vector_normalize(&vDir);
 	vector_add(&half, &lDir, &vDir);
 	vector_normalize(&half);
 	float specular = 2;
 	float gloss = 1;
-	float diff = vector_dotproduct(&lDir, &vertex->normal);
+	float diff = vector_dotproduct(&lDir, normal);
 	diff = diff < 0 ? 0 : diff;
 	int debugdiff = diff * 255;
-	int debugNx = vertex->normal.x * 255;
-	int debugNy = vertex->normal.y * 255;
-	int debugNz = abs(vertex->normal.z * 255);
+	int debugNx = normal->x * 255;
+	int debugNy = normal->y * 255;
+	int debugNz = abs(normal->z * 255);
 	int debugLx = lDir.x * 255;
 	int debugLy = lDir.y * 255;
 	int debugLz = lDir.z * 255;
 	//return (debugLx << 16) | (debugLy << 8) | debugLx;
 	//return (debugNx << 16) | (debugNy << 8) | debugNz;
 	//return (debugdiff << 16) | (debugdiff << 8) | debugdiff;
-	float nh = vector_dotproduct(&half, &vertex->normal);
+	float nh = vector_dotproduct(&half, normal);
 	float spec = pow(nh, specular) * gloss;
 	//rgb = albeda * lightColor * diff + lightColor * spec
 	int attenColor = color_mul2(color2int(light->color), 2 / (dist2Light * dist2Light));
@@ -951,138 +2142,2244 @@ int blinPhong(const vertex_t *vertex, const light_t* light, const device_t* devi
 	return color_add(diffcol, speccol);
 }
 
+// 累加设备所有光源的 blinPhong
+int device_lighting(const device_t *device, const point_t *wPos, const vector_t *normal, int albedo) {
+	int color = 0, i;
+	for (i = 0; i < device->light_count; i++) {
+		int c = blinPhong(wPos, normal, &device->lights[i], device, albedo);
+		color = (i == 0)? c : color_add(color, c);
+	}
+	return color;
+}
+
 //=====================================================================
 // 渲染实现
 //=====================================================================
 
-// 绘制扫描�
-void device_draw_scanline(device_t *device, scanline_t *scanline) {
-	IUINT32 *framebuffer = device->framebuffer[scanline->y];
-	float *zbuffer = device->zbuffer[scanline->y];
-	int x = scanline->x;
-	int w = scanline->w;
-	int width = device->width;
-	int render_state = device->render_state;
-	for (; w > 0; x++, w--) {
-		
-		if (x >= 0 && x < width) {
-			float rhw = scanline->v.rhw;
-			if (rhw >= zbuffer[x]) {	
-				float w = 1.0f / rhw;
-				zbuffer[x] = rhw;
-				if (render_state & RENDER_STATE_COLOR) {
-					float r = scanline->v.color.r * w;
-					float g = scanline->v.color.g * w;
-					float b = scanline->v.color.b * w;
-					int R = (int)(r * 255.0f);
-					int G = (int)(g * 255.0f);
-					int B = (int)(b * 255.0f);
-					R = CMID(R, 0, 255);
-					G = CMID(G, 0, 255);
-					B = CMID(B, 0, 255);
-					framebuffer[x] = (R << 16) | (G << 8) | (B);
-					framebuffer[x] = blinPhong(&scanline->v, &Light, device, framebuffer[x]);
-				}
-				if (render_state & RENDER_STATE_TEXTURE) {
-					float u = scanline->v.tc.u * w;
-					float v = scanline->v.tc.v * w;
-					IUINT32 cc = device_texture_read(device, u, v);
-					framebuffer[x] = cc;
-					framebuffer[x] = blinPhong(&scanline->v, &Light, device, framebuffer[x]);
-				}
-			}
+// 延迟着色的光照阶段：clip 内每个等待光照的像素由深度反投影得到世界坐标，计算一次 blinPhong
+void device_resolve_lighting(device_t *device, const rect_t *clip) {
+	const matrix_t *proj = &device->transform.projection;
+	int x, y;
+	for (y = clip->y0; y < clip->y1; y++) {
+		IUINT32 *framebuffer = device->framebuffer[y];
+		vector_t *gbuffer = device->gbuffer[y];
+		for (x = clip->x0; x < clip->x1; x++) {
+			point_t screen, wpos;
+			float rhw;
+			if (gbuffer[x].w == 0.0f) continue;
+			rhw = device_depth_rhw(device, x, y);
+			screen.x = (float)x + 0.5f;
+			screen.y = (float)y + 0.5f;
+			screen.z = proj->m[2][2] + proj->m[3][2] * rhw;	// z / w，投影矩阵 m[2][3] = 1
+			screen.w = 1.0f / rhw;
+			transform_homogenize_reverse(&wpos, &screen, device->transform.w, device->transform.h);
+			matrix_apply(&wpos, &wpos, &device->transform.vp_reverse);	// 由 device_flush 事先计算
+			framebuffer[x] = device_lighting(device, &wpos, &gbuffer[x], framebuffer[x]);
+			gbuffer[x].w = 0.0f;
 		}
-		vertex_add(&scanline->v, &scanline->step);
-		if (x >= width) break;
 	}
 }
 
-// 主渲染函�
-void device_render_trap(device_t *device, trapezoid_t *trap) {
+
+//=====================================================================
+// 半空间光栅化：用边函数按 8x8 像素块遍历包围盒，整块接受或拒绝，
+// 块内每行用一条 SIMD 指令测试 4/8 个像素的覆盖和深度
+//=====================================================================
+#define HS_BLOCK            8		// 像素块大小，同时是一次测试的像素数
+
+typedef struct {
+	float a[3], b[3], c[3];     // 边函数 E = a * x + b * y + c，三角形内部为正
+	int topleft[3];             // 左上规则：落在左边和上边上的像素算作覆盖
+	float x0, y0;               // 属性插值的原点
+	vertex_t base;              // 原点处的属性
+	vertex_t ddx, ddy;          // 属性在屏幕 x, y 方向的梯度
+	int minx, miny, maxx, maxy; // 包围盒，像素闭区间
+}	halfspace_t;
+
+// 由三个已完成 rhw 初始化的顶点建立边函数和属性平面，退化三角形返回 0
+int halfspace_init(halfspace_t *hs, const vertex_t *p1, const vertex_t *p2, const vertex_t *p3) {
+	const vertex_t *v[3];
+	float area, dx1, dy1, dx2, dy2;
+	int i;
+	v[0] = p1, v[1] = p2, v[2] = p3;
+	dx1 = p2->pos.x - p1->pos.x, dy1 = p2->pos.y - p1->pos.y;
+	dx2 = p3->pos.x - p1->pos.x, dy2 = p3->pos.y - p1->pos.y;
+	area = dx1 * dy2 - dx2 * dy1;
+	if (area == 0.0f) return 0;
+	if (area < 0.0f) v[1] = p3, v[2] = p2;		// 统一绕序，使内部边函数为正
+	for (i = 0; i < 3; i++) {
+		const point_t *s = &v[i]->pos, *e = &v[(i + 1) % 3]->pos;
+		// c 写成叉积形式，反向的公共边得到严格相反的系数，保证相邻三角形不重不漏
+		hs->a[i] = s->y - e->y;
+		hs->b[i] = e->x - s->x;
+		hs->c[i] = s->x * e->y - e->x * s->y;
+		hs->topleft[i] = (hs->a[i] > 0.0f || (hs->a[i] == 0.0f && hs->b[i] > 0.0f));
+	}
+	hs->x0 = v[0]->pos.x;
+	hs->y0 = v[0]->pos.y;
+	hs->base = *v[0];
+	vertex_gradient(&hs->ddx, &hs->ddy, v[0], v[1], v[2]);
+	hs->minx = (int)floor(min(min(p1->pos.x, p2->pos.x), p3->pos.x));
+	hs->miny = (int)floor(min(min(p1->pos.y, p2->pos.y), p3->pos.y));
+	hs->maxx = (int)ceil(max(max(p1->pos.x, p2->pos.x), p3->pos.x));
+	hs->maxy = (int)ceil(max(max(p1->pos.y, p2->pos.y), p3->pos.y));
+	return 1;
+}
+
+// 测试一行 8 个像素（像素中心 x + i + 0.5），返回覆盖且通过深度测试的位掩码，
+// 同时输出各像素的 rhw；edges 为 0 时该块已整体位于三角形内，只测试深度。
+// zrow 为 DEPTH_FLOAT 格式的一行深度，为 NULL 时不做深度测试
+static int halfspace_row(const halfspace_t *hs, int x, int y, const float *zrow, int edges, float *rhw) {
+	float px = (float)x + 0.5f, py = (float)y + 0.5f;
+	float r = hs->base.rhw + hs->ddx.rhw * (px - hs->x0) + hs->ddy.rhw * (py - hs->y0);
+	int mask = 0xff, k;
+#if defined(MINI3D_AVX)
+	const __m256 offs = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 vr;
+	for (k = 0; edges && k < 3; k++) {
+		float e = hs->a[k] * px + hs->b[k] * py + hs->c[k];
+		__m256 ve = _mm256_add_ps(_mm256_set1_ps(e), _mm256_mul_ps(_mm256_set1_ps(hs->a[k]), offs));
+		ve = hs->topleft[k]? _mm256_cmp_ps(ve, zero, _CMP_GE_OQ) : _mm256_cmp_ps(ve, zero, _CMP_GT_OQ);
+		mask &= _mm256_movemask_ps(ve);
+	}
+	vr = _mm256_add_ps(_mm256_set1_ps(r), _mm256_mul_ps(_mm256_set1_ps(hs->ddx.rhw), offs));
+	if (zrow) mask &= _mm256_movemask_ps(_mm256_cmp_ps(vr, _mm256_loadu_ps(zrow), _CMP_GE_OQ));
+	_mm256_storeu_ps(rhw, vr);
+#elif defined(MINI3D_SSE2)
+	const __m128 lo = _mm_set_ps(3, 2, 1, 0), hi = _mm_set_ps(7, 6, 5, 4);
+	const __m128 zero = _mm_setzero_ps();
+	__m128 vr, vd, rl, rh;
+	for (k = 0; edges && k < 3; k++) {
+		float e = hs->a[k] * px + hs->b[k] * py + hs->c[k];
+		__m128 ve = _mm_set1_ps(e), va = _mm_set1_ps(hs->a[k]);
+		__m128 el = _mm_add_ps(ve, _mm_mul_ps(va, lo));
+		__m128 eh = _mm_add_ps(ve, _mm_mul_ps(va, hi));
+		if (hs->topleft[k]) el = _mm_cmpge_ps(el, zero), eh = _mm_cmpge_ps(eh, zero);
+		else el = _mm_cmpgt_ps(el, zero), eh = _mm_cmpgt_ps(eh, zero);
+		mask &= _mm_movemask_ps(el) | (_mm_movemask_ps(eh) << 4);
+	}
+	vr = _mm_set1_ps(r);
+	vd = _mm_set1_ps(hs->ddx.rhw);
+	rl = _mm_add_ps(vr, _mm_mul_ps(vd, lo));
+	rh = _mm_add_ps(vr, _mm_mul_ps(vd, hi));
+	if (zrow) mask &= _mm_movemask_ps(_mm_cmpge_ps(rl, _mm_loadu_ps(zrow))) | 
+		(_mm_movemask_ps(_mm_cmpge_ps(rh, _mm_loadu_ps(zrow + 4))) << 4);
+	_mm_storeu_ps(rhw, rl);
+	_mm_storeu_ps(rhw + 4, rh);
+#else
+	int i;
+	for (k = 0; edges && k < 3; k++) {
+		float e = hs->a[k] * px + hs->b[k] * py + hs->c[k];
+		for (i = 0; i < HS_BLOCK; i++) {
+			float ei = e + hs->a[k] * (float)i;
+			if (hs->topleft[k]? ei < 0.0f : ei <= 0.0f) mask &= ~(1 << i);
+		}
+	}
+	for (i = 0; i < HS_BLOCK; i++) {
+		rhw[i] = r + hs->ddx.rhw * (float)i;
+		if (zrow && rhw[i] < zrow[i]) mask &= ~(1 << i);
+	}
+#endif
+	return mask;
+}
+
+//=====================================================================
+// 按平面方程求像素 (dx, dy) 处 mask 中的属性，rhw 由 halfspace_row 给出
+void halfspace_eval(vertex_t *v, const halfspace_t *hs, float dx, float dy, int mask) {
+	#define HALFSPACE_EVAL(f) v->f = hs->base.f + (hs->ddx.f * dx + hs->ddy.f * dy)
+	if (mask & VARYING_TEXCOORD) {
+		HALFSPACE_EVAL(tc.u);
+		HALFSPACE_EVAL(tc.v);
+	}
+	if (mask & VARYING_COLOR) {
+		HALFSPACE_EVAL(color.r);
+		HALFSPACE_EVAL(color.g);
+		HALFSPACE_EVAL(color.b);
+	}
+	if (mask & VARYING_NORMAL) {
+		HALFSPACE_EVAL(normal.x);
+		HALFSPACE_EVAL(normal.y);
+		HALFSPACE_EVAL(normal.z);
+	}
+	if (mask & VARYING_WPOS) {
+		HALFSPACE_EVAL(wpos.x);
+		HALFSPACE_EVAL(wpos.y);
+		HALFSPACE_EVAL(wpos.z);
+	}
+	#undef HALFSPACE_EVAL
+}
+
+// 着色器：顶点阶段 appdata -> v2f，片元阶段 v2f -> surface_t。
+// 扫描线和像素块的内层循环用宏按着色器实例化，render_state 分支、
+// 未声明属性的透视校正都在编译期消除
+//=====================================================================
+typedef void (*vertex_shader_t)(const device_t *device, const appdata *in, v2f *out);
+typedef void (*scanline_proc_t)(device_t *device, const scanline_t *scanline, const rect_t *clip);
+typedef void (*pixels_proc_t)(device_t *device, const halfspace_t *hs, int x, int y, int mask, const float *rhw);
+
+typedef struct shader_s {
+	vertex_shader_t vertex;     // 顶点着色器
+	int varyings;               // 片元着色器读取的属性 VARYING_*
+	int lit;                    // 是否对表面做 blinPhong 光照
+	int live[2];                // 光栅化时需要插值的属性：[0] 前向渲染，[1] 延迟渲染
+	scanline_proc_t scanline[2][DEPTH_FORMATS];    // 梯形扫描线：[0] 前向渲染，[1] 延迟渲染，按深度格式展开
+	pixels_proc_t pixels[2];        // 半空间一行内 mask 所示像素的着色
+}	shader_t;
+
+// 需要插值的属性：前向渲染的光照还要用到世界坐标，纹理坐标导数需要纹理坐标
+#define SHADER_LIVE(VARYINGS, LIT, DEFERRED) \
+	((VARYINGS) | (((LIT) && !(DEFERRED))? VARYING_WPOS : 0) | \
+	(((VARYINGS) & VARYING_TEXGRAD)? VARYING_TEXCOORD : 0))
+
+// 片元阶段：透视校正声明的属性，调用片元着色器 FS，写入颜色或 G-buffer
+#define SHADER_PIXEL(device, vertex, X, Y, DDX, DDY, FS, VARYINGS, LIT, DEFERRED) do { \
+		v2f in_; \
+		surface_t out_; \
+		float w_ = 1.0f / (vertex).rhw; \
+		in_.pos.x = (float)(X); \
+		in_.pos.y = (float)(Y); \
+		in_.pos.z = 0.0f; \
+		in_.pos.w = (vertex).rhw; \
+		if (SHADER_LIVE(VARYINGS, LIT, DEFERRED) & VARYING_TEXCOORD) { \
+			in_.tex.u = (vertex).tc.u * w_; \
+			in_.tex.v = (vertex).tc.v * w_; \
+		} \
+		if ((VARYINGS) & VARYING_TEXGRAD) { \
+			/* d(u) = (d(u * rhw) - u * d(rhw)) / rhw */ \
+			in_.tex_ddx.u = ((DDX)->tc.u - in_.tex.u * (DDX)->rhw) * w_; \
+			in_.tex_ddx.v = ((DDX)->tc.v - in_.tex.v * (DDX)->rhw) * w_; \
+			in_.tex_ddy.u = ((DDY)->tc.u - in_.tex.u * (DDY)->rhw) * w_; \
+			in_.tex_ddy.v = ((DDY)->tc.v - in_.tex.v * (DDY)->rhw) * w_; \
+		} \
+		if ((VARYINGS) & VARYING_COLOR) { \
+			in_.color.r = (vertex).color.r * w_; \
+			in_.color.g = (vertex).color.g * w_; \
+			in_.color.b = (vertex).color.b * w_; \
+		} \
+		if ((VARYINGS) & VARYING_NORMAL) { \
+			in_.normal.x = (vertex).normal.x * w_; \
+			in_.normal.y = (vertex).normal.y * w_; \
+			in_.normal.z = (vertex).normal.z * w_; \
+			in_.normal.w = 0.0f; \
+		} \
+		if (SHADER_LIVE(VARYINGS, LIT, DEFERRED) & VARYING_WPOS) { \
+			in_.wpos.x = (vertex).wpos.x * w_; \
+			in_.wpos.y = (vertex).wpos.y * w_; \
+			in_.wpos.z = (vertex).wpos.z * w_; \
+			in_.wpos.w = 1.0f; \
+		} \
+		FS(device, &in_, &out_); \
+		if (DEFERRED) { \
+			vector_t *g_ = &(device)->gbuffer[Y][X]; \
+			*g_ = out_.normal; \
+			g_->w = (LIT)? 1.0f : 0.0f; \
+			(device)->framebuffer[Y][X] = out_.albedo; \
+		}	else { \
+			if ((device)->gbuffer) (device)->gbuffer[Y][X].w = 0.0f;	/* 覆盖了延迟绘制的像素 */ \
+			if (LIT) (device)->framebuffer[Y][X] = device_lighting(device, &in_.wpos, &out_.normal, out_.albedo); \
+			else (device)->framebuffer[Y][X] = out_.albedo; \
+		} \
+	}	while (0)
+
+// 梯形扫描线，只绘制 clip 横向范围内的像素，深度按 DEPTH 格式测试和写入
+#define SHADER_SCANLINE(name, FS, VARYINGS, LIT, DEFERRED, DEPTH) \
+static void name(device_t *device, const scanline_t *scanline, const rect_t *clip) { \
+	void *zbuffer = device->zbuffer[scanline->y]; \
+	int start = max(scanline->x, clip->x0); \
+	int end = min(scanline->x + scanline->w, clip->x1); \
+	float scale = DEPTH_SCALE(device), bias = DEPTH_BIAS(device); \
+	vertex_t vertex; \
+	int x; \
+	(void)scale, (void)bias; \
+	if (start < end) device_hiz_touch(device, start, end, scanline->y); \
+	/* 起点和每个分块边界都由扫描线起点直接定位，使分块渲染和整屏渲染逐像素一致 */ \
+	vertex_seek(&vertex, &scanline->v, &scanline->step, (float)(start - scanline->x), \
+		SHADER_LIVE(VARYINGS, LIT, DEFERRED)); \
+	for (x = start; x < end; x++) { \
+		if ((x & (TILE_SIZE - 1)) == 0) \
+			vertex_seek(&vertex, &scanline->v, &scanline->step, (float)(x - scanline->x), \
+				SHADER_LIVE(VARYINGS, LIT, DEFERRED)); \
+		{ \
+			DEPTH_TYPE_##DEPTH d = DEPTH_ENCODE_##DEPTH(vertex.rhw, scale, bias); \
+			if (d >= DEPTH_LOAD_##DEPTH(zbuffer, x)) { \
+				DEPTH_STORE_##DEPTH(zbuffer, x, d); \
+				SHADER_PIXEL(device, vertex, x, scanline->y, &scanline->step, scanline->ddy, \
+					FS, VARYINGS, LIT, DEFERRED); \
+			} \
+		} \
+		vertex_add(&vertex, &scanline->step, SHADER_LIVE(VARYINGS, LIT, DEFERRED)); \
+	} \
+}
+
+// 每种深度格式一条扫描线，由 DEPTH_TABLE 组成表
+#define SHADER_SCANLINES(name, FS, VARYINGS, LIT, DEFERRED) \
+	SHADER_SCANLINE(name##_float, FS, VARYINGS, LIT, DEFERRED, FLOAT) \
+	SHADER_SCANLINE(name##_unorm16, FS, VARYINGS, LIT, DEFERRED, UNORM16) \
+	SHADER_SCANLINE(name##_unorm24, FS, VARYINGS, LIT, DEFERRED, UNORM24)
+
+// 半空间光栅化一行中已通过覆盖和深度测试的像素，rhw 为各像素的深度，深度已由调用者写入
+#define SHADER_PIXELS(name, FS, VARYINGS, LIT, DEFERRED) \
+static void name(device_t *device, const halfspace_t *hs, int x, int y, int mask, const float *rhw) { \
+	float dy = (float)y + 0.5f - hs->y0; \
+	int i; \
+	for (i = 0; mask != 0; i++, mask >>= 1) { \
+		vertex_t vertex; \
+		float dx = (float)(x + i) + 0.5f - hs->x0; \
+		if ((mask & 1) == 0) continue; \
+		halfspace_eval(&vertex, hs, dx, dy, SHADER_LIVE(VARYINGS, LIT, DEFERRED)); \
+		vertex.rhw = rhw[i]; \
+		SHADER_PIXEL(device, vertex, x + i, y, &hs->ddx, &hs->ddy, FS, VARYINGS, LIT, DEFERRED); \
+	} \
+}
+
+// 定义着色器 name：VS 为顶点着色器，FS 为片元着色器 void FS(const device_t*, const v2f*, surface_t*)，
+// VARYINGS 为 FS 读取的属性，LIT 非 0 时对表面做光照
+#define SHADER_DEFINE(name, VS, FS, VARYINGS, LIT) \
+	SHADER_SCANLINES(name##_scanline_forward, FS, VARYINGS, LIT, 0) \
+	SHADER_SCANLINES(name##_scanline_deferred, FS, VARYINGS, LIT, 1) \
+	SHADER_PIXELS(name##_pixels_forward, FS, VARYINGS, LIT, 0) \
+	SHADER_PIXELS(name##_pixels_deferred, FS, VARYINGS, LIT, 1) \
+	shader_t name = { VS, VARYINGS, LIT, \
+		{ SHADER_LIVE(VARYINGS, LIT, 0), SHADER_LIVE(VARYINGS, LIT, 1) }, \
+		{ DEPTH_TABLE(name##_scanline_forward), DEPTH_TABLE(name##_scanline_deferred) }, \
+		{ name##_pixels_forward, name##_pixels_deferred } };
+
+// 默认顶点着色器：变换到裁剪空间，输出世界坐标和世界空间法线
+void vertex_shader_default(const device_t *device, const appdata *in, v2f *out) {
+	matrix_apply(&out->pos, &in->pos, &device->transform.transform);
+	matrix_apply(&out->wpos, &in->pos, &device->transform.world);
+	matrix_apply(&out->normal, &in->normal, &device->transform.normal);
+	out->tex = in->tex;
+	out->color = in->color;
+}
+
+// 顶点颜色
+static void fragment_color(const device_t *device, const v2f *in, surface_t *out) {
+	int R = (int)(in->color.r * 255.0f);
+	int G = (int)(in->color.g * 255.0f);
+	int B = (int)(in->color.b * 255.0f);
+	(void)device;
+	R = CMID(R, 0, 255);
+	G = CMID(G, 0, 255);
+	B = CMID(B, 0, 255);
+	out->albedo = (R << 16) | (G << 8) | (B);
+	out->normal = in->normal;
+	vector_normalize(&out->normal);
+}
+
+// 纹理颜色
+static void fragment_texture(const device_t *device, const v2f *in, surface_t *out) {
+	out->albedo = device_texture_sample(device, in->tex.u, in->tex.v, &in->tex_ddx, &in->tex_ddy);
+	out->normal = in->normal;
+	vector_normalize(&out->normal);
+}
+
+SHADER_DEFINE(shader_color, vertex_shader_default, fragment_color, 
+	VARYING_COLOR | VARYING_NORMAL | VARYING_WPOS, 1)
+SHADER_DEFINE(shader_texture, vertex_shader_default, fragment_texture, 
+	VARYING_TEXCOORD | VARYING_TEXGRAD | VARYING_NORMAL | VARYING_WPOS, 1)
+
+// 只写深度的扫描线，只步进 rhw，步进方式同 SHADER_SCANLINE 以得到相同的深度；
+// 写入深度的像素不再等待延迟光照
+#define DEPTH_SCANLINE(name, DEPTH) \
+static void name(device_t *device, const scanline_t *scanline, const rect_t *clip) { \
+	void *zbuffer = device->zbuffer[scanline->y]; \
+	vector_t *gbuffer = device->gbuffer? device->gbuffer[scanline->y] : NULL; \
+	int start = max(scanline->x, clip->x0); \
+	int end = min(scanline->x + scanline->w, clip->x1); \
+	float scale = DEPTH_SCALE(device), bias = DEPTH_BIAS(device); \
+	float step = scanline->step.rhw, rhw; \
+	int x; \
+	(void)scale, (void)bias; \
+	if (start < end) device_hiz_touch(device, start, end, scanline->y); \
+	rhw = scanline->v.rhw + step * (float)(start - scanline->x); \
+	for (x = start; x < end; x++) { \
+		DEPTH_TYPE_##DEPTH d; \
+		if ((x & (TILE_SIZE - 1)) == 0) \
+			rhw = scanline->v.rhw + step * (float)(x - scanline->x); \
+		d = DEPTH_ENCODE_##DEPTH(rhw, scale, bias); \
+		if (d >= DEPTH_LOAD_##DEPTH(zbuffer, x)) { \
+			DEPTH_STORE_##DEPTH(zbuffer, x, d); \
+			if (gbuffer) gbuffer[x].w = 0.0f; \
+		} \
+		rhw += step; \
+	} \
+}
+
+DEPTH_SCANLINE(depth_scanline_float, FLOAT)
+DEPTH_SCANLINE(depth_scanline_unorm16, UNORM16)
+DEPTH_SCANLINE(depth_scanline_unorm24, UNORM24)
+
+static const scanline_proc_t depth_scanline[DEPTH_FORMATS] = DEPTH_TABLE(depth_scanline);
+
+// 半空间一行的深度测试和写入：rhw 中 mask 所示的像素按 DEPTH 格式编码后与 row[x + i] 比较，
+// 写入通过的像素，返回通过的掩码
+#define DEPTH_ROW(name, DEPTH) \
+static int name(const device_t *device, void *row, int x, const float *rhw, int mask) { \
+	float scale = DEPTH_SCALE(device), bias = DEPTH_BIAS(device); \
+	int i, pass = 0; \
+	(void)scale, (void)bias; \
+	for (i = 0; (mask >> i) != 0; i++) { \
+		DEPTH_TYPE_##DEPTH d; \
+		if ((mask & (1 << i)) == 0) continue; \
+		d = DEPTH_ENCODE_##DEPTH(rhw[i], scale, bias); \
+		if (d >= DEPTH_LOAD_##DEPTH(row, x + i)) { \
+			DEPTH_STORE_##DEPTH(row, x + i, d); \
+			pass |= 1 << i; \
+		} \
+	} \
+	return pass; \
+}
+
+typedef int (*depth_row_proc_t)(const device_t *device, void *row, int x, const float *rhw, int mask);
+
+DEPTH_ROW(depth_row_float, FLOAT)
+DEPTH_ROW(depth_row_unorm16, UNORM16)
+DEPTH_ROW(depth_row_unorm24, UNORM24)
+
+static const depth_row_proc_t depth_row[DEPTH_FORMATS] = DEPTH_TABLE(depth_row);
+
+// 当前使用的着色器：自定义着色器优先，否则纹理优先于颜色
+static const shader_t *device_shader(const device_t *device) {
+	if (device->shader) return device->shader;
+	return (device->render_state & RENDER_STATE_TEXTURE)? &shader_texture : &shader_color;
+}
+
+// 主渲染函数，只绘制 clip 范围内的扫描线
+void device_render_trap(device_t *device, trapezoid_t *trap, const rect_t *clip) {
+	const shader_t *shader = device_shader(device);
+	int deferred = (device->render_state & RENDER_STATE_DEFERRED)? 1 : 0;
+	int depth = device->render_state & RENDER_STATE_DEPTH;
+	scanline_proc_t draw = depth? depth_scanline[device->depth_format] : 
+		shader->scanline[deferred][device->depth_format];
+	int live = depth? 0 : shader->live[deferred];
 	scanline_t scanline;
 	int j, top, bottom;
 	top = (int)(trap->top + 0.5f);
 	bottom = (int)(trap->bottom + 0.5f);
+	if (top < clip->y0) top = clip->y0;
+	if (bottom > clip->y1) bottom = clip->y1;
+	if (top >= bottom) return;
+	{	// 梯形在 clip 内的部分整个被遮挡时跳过
+		const edge_t *l = &trap->left, *r = &trap->right;
+		float t0 = (float)top + 0.5f, t1 = (float)bottom - 0.5f;
+		float lx0 = l->v1.pos.x + l->step.pos.x * (t0 - l->v1.pos.y);
+		float lx1 = l->v1.pos.x + l->step.pos.x * (t1 - l->v1.pos.y);
+		float rx0 = r->v1.pos.x + r->step.pos.x * (t0 - r->v1.pos.y);
+		float rx1 = r->v1.pos.x + r->step.pos.x * (t1 - r->v1.pos.y);
+		float z = max(max(l->v1.rhw + l->step.rhw * (t0 - l->v1.pos.y), l->v1.rhw + l->step.rhw * (t1 - l->v1.pos.y)), 
+			max(r->v1.rhw + r->step.rhw * (t0 - r->v1.pos.y), r->v1.rhw + r->step.rhw * (t1 - r->v1.pos.y)));
+		z += (float)(fabs(trap->step.rhw) + fabs(trap->ddy.rhw)) + z * 1e-5f;
+		if (device_hiz_occluded(device, max((int)floor(min(lx0, lx1)), clip->x0), top, 
+			min((int)ceil(max(rx0, rx1)) + 1, clip->x1), bottom, z)) return;
+	}
 	for (j = top; j < bottom; j++) {
-		if (j >= 0 && j < device->height) {
- 			trapezoid_edge_interp(trap, (float)j + 0.5f);
-			trapezoid_init_scan_line(trap, &scanline, j);
-			device_draw_scanline(device, &scanline);
+		// 起始行和分块边界由端点直接定位，其余各行沿边累加增量
+		if (j == top || (j & (TILE_SIZE - 1)) == 0) 
+ 			trapezoid_edge_interp(trap, (float)j + 0.5f, live);
+		else 
+			trapezoid_edge_step(trap, live);
+		trapezoid_init_scan_line(trap, &scanline, j, live);
+		draw(device, &scanline, clip);
+	}
+}
+
+// 按 8x8 块绘制三角形，只绘制 clip 范围内的像素
+void device_render_halfspace(device_t *device, const halfspace_t *hs, const rect_t *clip) {
+	pixels_proc_t pixels = (device->render_state & RENDER_STATE_DEPTH)? NULL : 
+		device_shader(device)->pixels[(device->render_state & RENDER_STATE_DEFERRED)? 1 : 0];
+	depth_row_proc_t test = depth_row[device->depth_format];
+	int native = (device->depth_format == DEPTH_FLOAT);	// 浮点 rhw 直接在 halfspace_row 中用 SIMD 比较
+	int minx = max(hs->minx, clip->x0);
+	int miny = max(hs->miny, clip->y0);
+	int maxx = min(hs->maxx, clip->x1 - 1);
+	int maxy = min(hs->maxy, clip->y1 - 1);
+	int bx, by, y, k, i;
+	for (by = miny & ~(HS_BLOCK - 1); by <= maxy; by += HS_BLOCK) {
+		int y0 = max(by, miny);
+		int y1 = min(by + HS_BLOCK - 1, maxy);
+		for (bx = minx & ~(HS_BLOCK - 1); bx <= maxx; bx += HS_BLOCK) {
+			float cx = (float)bx + 0.5f, cy = (float)by + 0.5f;
+			float extent = (float)(HS_BLOCK - 1);
+			int lanes = 0xff, edges = 0;
+			// 用块四角的边函数极值整块拒绝或整块接受
+			for (k = 0; k < 3; k++) {
+				float e = hs->a[k] * cx + hs->b[k] * cy + hs->c[k];
+				float ex = hs->a[k] * extent, ey = hs->b[k] * extent;
+				float emax = e + max(ex, 0.0f) + max(ey, 0.0f);
+				float emin = e + min(ex, 0.0f) + min(ey, 0.0f);
+				if (emax < 0.0f) break;
+				if (emin <= 0.0f) edges = 1;
+			}
+			if (k < 3) continue;
+			{	// 块内最近的 rhw 不超过 Hi-Z 时整块被遮挡
+				float z = hs->base.rhw + hs->ddx.rhw * (cx - hs->x0) + hs->ddy.rhw * (cy - hs->y0);
+				z += max(hs->ddx.rhw * extent, 0.0f) + max(hs->ddy.rhw * extent, 0.0f);
+				z += z * 1e-5f;
+				if (z < device_hiz_get(device, bx / HIZ_TILE, by / HIZ_TILE)) continue;
+			}
+			device_clear_check(device, bx / HIZ_TILE, by / HIZ_TILE);
+			if (bx < minx) lanes &= 0xff << (minx - bx);
+			if (bx + HS_BLOCK - 1 > maxx) lanes &= 0xff >> (bx + HS_BLOCK - 1 - maxx);
+			for (y = y0; y <= y1; y++) {
+				float *zrow = native? (float*)device->zbuffer[y] + bx : NULL;
+				float zcopy[HS_BLOCK], rhw[HS_BLOCK];
+				int mask;
+				if (zrow && bx + HS_BLOCK > device->width) {	// 屏幕右边缘不足一块，避免越界读取
+					for (i = 0; i < HS_BLOCK; i++) 
+						zcopy[i] = (bx + i < device->width)? zrow[i] : 0.0f;
+					zrow = zcopy;
+				}
+				mask = halfspace_row(hs, bx, y, zrow, edges, rhw) & lanes;
+				if (mask && native) {	// 已经比较过，直接写入
+					float *dst = (float*)device->zbuffer[y] + bx;
+					for (i = 0; i < HS_BLOCK; i++) 
+						if (mask & (1 << i)) dst[i] = rhw[i];
+				}
+				else if (mask) mask = test(device, device->zbuffer[y], bx, rhw, mask);
+				if (mask) {
+					if (pixels) pixels(device, hs, bx, y, mask, rhw);
+					else if (device->gbuffer) {	// 只写深度，像素不再等待延迟光照
+						for (i = 0; i < HS_BLOCK; i++) 
+							if (mask & (1 << i)) device->gbuffer[y][bx + i].w = 0.0f;
+					}
+					device->hiz_dirty[(by / HIZ_TILE) * device->hiz_w + bx / HIZ_TILE] = 1;
+				}
+			}
 		}
-		if (j >= device->height) break;
 	}
 }
 
-// 根据 render_state 绘制原始三角�
+//=====================================================================
+// 分块光栅化：三角形只设置一次并按 TILE_SIZE 分块登记，
+// 每个工作线程独占一个块的颜色和深度，无锁绘制
+//=====================================================================
+#define BIN_TRAP        0		// 梯形
+#define BIN_LINE        1		// 线框线段
+#define BIN_HALFSPACE   2		// 半空间三角形
+
+typedef struct { int x1, y1, x2, y2; IUINT32 color; } bin_line_t;
+
+typedef struct {
+	int type;                   // BIN_TRAP / BIN_LINE / BIN_HALFSPACE
+	int state;                  // 提交时的设备状态，对应 binner_t::states 下标
+	float bounds[4];            // 覆盖的像素范围 x0, y0, x1, y1
+	union {
+		trapezoid_t trap;       // 已完成设置的梯形
+		halfspace_t tri;        // 已完成设置的三角形
+		bin_line_t line;        // 线段
+	}	prim;
+}	bin_cmd_t;
+
+typedef struct { const bin_cmd_t **cmds; int count; int capacity; } bin_tile_t;
+
+#define BIN_BLOCK       64		// 命令按块分配，flush 之前地址不变
+
+// 一串命令，按提交顺序存放。并行设置时每段图元写入自己的暂存区，
+// 全部完成后再按段的顺序登记到块中，分块结果与串行设置相同
+typedef struct bin_stage_s {
+	bin_cmd_t **blocks;         // 每块 BIN_BLOCK 个命令，flush 后保留复用
+	int block_count;
+	int count;                  // 命令数
+	device_t *states;           // 暂存命令的设备状态快照
+	int state_count, state_capacity;
+	rect_t dirty;               // 设置后的 gbuffer_dirty
+}	bin_stage_t;
+
+typedef struct { vertex_post_t *vcache; int vcache_size; } bin_scratch_t;
+
+typedef struct binner_s {
+	sched_t sched;              // 几何和光栅化共用的任务调度，线程数包括调用线程
+	int tiles_x, tiles_y;       // 分块数量
+	bin_tile_t *tiles;          // 每块按提交顺序登记的命令
+	bin_stage_t direct;         // 调用线程直接登记的命令
+	int cmd_count;              // 本帧已登记的命令数
+	device_t *states;           // 设备状态快照，工作线程据此着色
+	int state_count, state_capacity;
+	device_t *device;           // 正在 flush 的设备
+	bin_stage_t *stages;        // 并行设置的各段暂存区，本帧用了 stage_count 个
+	int stage_count, stage_capacity;
+	bin_scratch_t *scratch;     // 每个线程设置图元时用的顶点缓存
+	int resolve;                // 绘制完每块后做延迟光照所用的状态快照，-1 表示不需要
+	rect_t resolve_rect;        // 需要延迟光照的范围
+	device_t *depth_states;     // 与 states 一一对应的只写深度的快照
+	int depth_capacity;
+	int prepass;                // 本帧是否有开启 Z-prepass 的快照
+}	binner_t;
+
+// 设备状态与上一个快照不同时追加新快照，返回快照下标。光栅化不使用 gbuffer_dirty，
+// 比较时跳过，延迟着色时不会每个三角形都产生新快照
+static int state_append(device_t **states, int *count, int *capacity, const device_t *device) {
+	int last = *count - 1;
+	if (last >= 0) {
+		const char *p = (const char*)&(*states)[last], *q = (const char*)device;
+		size_t head = (const char*)&device->gbuffer_dirty - q, tail = head + sizeof(rect_t);
+		if (memcmp(p, q, head) == 0 && memcmp(p + tail, q + tail, sizeof(device_t) - tail) == 0)
+			return last;
+	}
+	if (*count >= *capacity) {
+		*capacity = *capacity * 2 + 8;
+		*states = (device_t*)realloc(*states, sizeof(device_t) * *capacity);
+		assert(*states);
+	}
+	(*states)[*count] = *device;
+	return (*count)++;
+}
+
+static int binner_state(const device_t *device) {
+	binner_t *bin = device->binner;
+	return state_append(&bin->states, &bin->state_count, &bin->state_capacity, device);
+}
+
+#define stage_cmd(stage, i) (&(stage)->blocks[(i) / BIN_BLOCK][(i) % BIN_BLOCK])
+
+static bin_cmd_t *stage_append(bin_stage_t *stage) {
+	if (stage->count >= stage->block_count * BIN_BLOCK) {
+		stage->blocks = (bin_cmd_t**)realloc(stage->blocks, sizeof(bin_cmd_t*) * (stage->block_count + 1));
+		assert(stage->blocks);
+		stage->blocks[stage->block_count] = (bin_cmd_t*)malloc(sizeof(bin_cmd_t) * BIN_BLOCK);
+		assert(stage->blocks[stage->block_count]);
+		stage->block_count++;
+	}
+	stage->count++;
+	return stage_cmd(stage, stage->count - 1);
+}
+
+static void stage_destroy(bin_stage_t *stage) {
+	int i;
+	for (i = 0; i < stage->block_count; i++) free(stage->blocks[i]);
+	free(stage->blocks);
+	free(stage->states);
+}
+
+// 把命令登记到它覆盖的所有块
+static void binner_register(const device_t *device, const bin_cmd_t *cmd) {
+	binner_t *bin = device->binner;
+	float x0 = cmd->bounds[0], y0 = cmd->bounds[1], x1 = cmd->bounds[2], y1 = cmd->bounds[3];
+	int tx0, ty0, tx1, ty1, tx, ty;
+	bin->cmd_count++;
+	if (x1 < 0.0f || y1 < 0.0f || x0 >= (float)device->width || y0 >= (float)device->height)
+		return;
+	tx0 = (x0 <= 0.0f)? 0 : (int)x0 / TILE_SIZE;
+	ty0 = (y0 <= 0.0f)? 0 : (int)y0 / TILE_SIZE;
+	tx1 = (x1 >= (float)device->width)? bin->tiles_x - 1 : (int)x1 / TILE_SIZE;
+	ty1 = (y1 >= (float)device->height)? bin->tiles_y - 1 : (int)y1 / TILE_SIZE;
+	for (ty = ty0; ty <= ty1; ty++) {
+		for (tx = tx0; tx <= tx1; tx++) {
+			bin_tile_t *tile = &bin->tiles[ty * bin->tiles_x + tx];
+			if (tile->count >= tile->capacity) {
+				tile->capacity = tile->capacity * 2 + 16;
+				tile->cmds = (const bin_cmd_t**)realloc((void*)tile->cmds, sizeof(bin_cmd_t*) * tile->capacity);
+				assert(tile->cmds);
+			}
+			tile->cmds[tile->count++] = cmd;
+		}
+	}
+}
+
+// 追加一个覆盖 [x0, x1] x [y0, y1] 的命令并返回，由调用者填写图元；
+// 有暂存区时先写入暂存区，由 binner_merge 按顺序登记
+static bin_cmd_t *binner_add(device_t *device, int type, float x0, float y0, float x1, float y1) {
+	bin_stage_t *stage = device->stage;
+	bin_cmd_t *cmd = stage_append((stage != NULL)? stage : &device->binner->direct);
+	cmd->type = type;
+	cmd->bounds[0] = x0, cmd->bounds[1] = y0, cmd->bounds[2] = x1, cmd->bounds[3] = y1;
+	if (stage != NULL) {
+		cmd->state = state_append(&stage->states, &stage->state_count, &stage->state_capacity, device);
+	}	else {
+		cmd->state = binner_state(device);
+		binner_register(device, cmd);
+	}
+	return cmd;
+}
+
+void binner_add_trap(device_t *device, const trapezoid_t *trap) {
+	int top = (int)(trap->top + 0.5f);
+	int bottom = (int)(trap->bottom + 0.5f);
+	float x0 = (trap->left.v1.pos.x < trap->left.v2.pos.x)? trap->left.v1.pos.x : trap->left.v2.pos.x;
+	float x1 = (trap->right.v1.pos.x > trap->right.v2.pos.x)? trap->right.v1.pos.x : trap->right.v2.pos.x;
+	if (top >= bottom) return;
+	binner_add(device, BIN_TRAP, x0, (float)top, x1 + 1.0f, (float)(bottom - 1))->prim.trap = *trap;
+}
+
+void binner_add_halfspace(device_t *device, const halfspace_t *hs) {
+	binner_add(device, BIN_HALFSPACE, (float)hs->minx, (float)hs->miny, 
+		(float)hs->maxx, (float)hs->maxy)->prim.tri = *hs;
+}
+
+void binner_add_line(device_t *device, int x1, int y1, int x2, int y2, IUINT32 c) {
+	bin_line_t *line = &binner_add(device, BIN_LINE, (float)min(x1, x2), (float)min(y1, y2), 
+		(float)max(x1, x2), (float)max(y1, y2))->prim.line;
+	line->x1 = x1, line->y1 = y1, line->x2 = x2, line->y2 = y2, line->color = c;
+}
+
+// 按顺序把暂存区的命令登记到块中，状态快照逐个并入
+static void binner_merge(device_t *device, bin_stage_t *stage) {
+	int i, last = -1, state = 0;
+	for (i = 0; i < stage->count; i++) {
+		bin_cmd_t *cmd = stage_cmd(stage, i);
+		if (cmd->state != last) {
+			device_t snapshot = stage->states[last = cmd->state];
+			snapshot.stage = NULL;	// 与调用线程的状态一致，可以合并相同的快照
+			snapshot.vcache = device->vcache;
+			snapshot.vcache_size = device->vcache_size;
+			state = binner_state(&snapshot);
+		}
+		cmd->state = state;
+		binner_register(device, cmd);
+	}
+}
+
+// 绘制一个块，然后完成块内的清除和延迟光照
+static void binner_run_tile(binner_t *bin, int index) {
+	const bin_tile_t *tile = &bin->tiles[index];
+	device_t *screen = bin->device;	// 各快照共用同一份帧缓存
+	rect_t clip;
+	int i;
+	clip.x0 = (index % bin->tiles_x) * TILE_SIZE;
+	clip.y0 = (index / bin->tiles_x) * TILE_SIZE;
+	clip.x1 = min(clip.x0 + TILE_SIZE, screen->width);
+	clip.y1 = min(clip.y0 + TILE_SIZE, screen->height);
+	if (tile->count == 0) {
+		device_clear_resolve(screen, &clip);
+		return;
+	}
+	// Z-prepass：先只画深度。之后着色时 rhw 与深度缓存计算方式相同，
+	// 深度测试 >= 只对与最终深度相等的像素通过，相当于相等测试
+	for (i = 0; bin->prepass && i < tile->count; i++) {
+		const bin_cmd_t *cmd = tile->cmds[i];
+		device_t *device = &bin->depth_states[cmd->state];
+		if ((device->render_state & RENDER_STATE_ZPREPASS) == 0) continue;
+		if (cmd->type == BIN_TRAP) {
+			trapezoid_t trap = cmd->prim.trap;
+			device_render_trap(device, &trap, &clip);
+		}	else if (cmd->type == BIN_HALFSPACE) {
+			device_render_halfspace(device, &cmd->prim.tri, &clip);
+		}
+	}
+	for (i = 0; i < tile->count; i++) {
+		const bin_cmd_t *cmd = tile->cmds[i];
+		device_t *device = &bin->states[cmd->state];
+		if (cmd->type == BIN_TRAP) {
+			trapezoid_t trap = cmd->prim.trap;	// 边缘插值会改写梯形，各线程使用副本
+			device_render_trap(device, &trap, &clip);
+		}	else if (cmd->type == BIN_HALFSPACE) {
+			device_render_halfspace(device, &cmd->prim.tri, &clip);
+		}	else {
+			const bin_line_t *line = &cmd->prim.line;
+			device_draw_line_clip(device, line->x1, line->y1, line->x2, line->y2, line->color, &clip);
+		}
+	}
+	device_clear_resolve(screen, &clip);
+	if (bin->resolve >= 0) {
+		clip.x0 = max(clip.x0, bin->resolve_rect.x0);
+		clip.y0 = max(clip.y0, bin->resolve_rect.y0);
+		clip.x1 = min(clip.x1, bin->resolve_rect.x1);
+		clip.y1 = min(clip.y1, bin->resolve_rect.y1);
+		device_resolve_lighting(&bin->states[bin->resolve], &clip);
+	}
+}
+
+static void binner_tiles_job(void *arg, int begin, int end, int thread) {
+	binner_t *bin = (binner_t*)arg;
+	int i;
+	(void)thread;
+	for (i = begin; i < end; i++) binner_run_tile(bin, i);
+}
+
+// 有状态开启 Z-prepass 时，为所有快照生成只写深度的版本
+static void binner_prepass(binner_t *bin) {
+	int i;
+	bin->prepass = 0;
+	for (i = 0; i < bin->state_count; i++) 
+		if (bin->states[i].render_state & RENDER_STATE_ZPREPASS) bin->prepass = 1;
+	if (bin->prepass == 0) return;
+	if (bin->depth_capacity < bin->state_count) {
+		bin->depth_capacity = bin->state_capacity;
+		bin->depth_states = (device_t*)realloc(bin->depth_states, sizeof(device_t) * bin->depth_capacity);
+		assert(bin->depth_states);
+	}
+	for (i = 0; i < bin->state_count; i++) {
+		bin->depth_states[i] = bin->states[i];
+		bin->depth_states[i].render_state |= RENDER_STATE_DEPTH;
+	}
+}
+
+// 绘制所有已分块的图元，并完成延迟着色的光照
+void device_flush(device_t *device) {
+	binner_t *bin = device->binner;
+	job_t job;
+	int i;
+	rect_t dirty = device->gbuffer_dirty;
+	device->gbuffer_dirty.x1 = device->gbuffer_dirty.x0;
+	if (dirty.x0 < dirty.x1) transform_vp_reverse(&device->transform);
+	if (bin == NULL || (bin->cmd_count == 0 && bin->sched.threads <= 1)) {
+		rect_t screen = { 0, 0, device->width, device->height };
+		if (dirty.x0 < dirty.x1) device_resolve_lighting(device, &dirty);
+		device_clear_resolve(device, &screen);
+		return;
+	}
+	bin->resolve = (dirty.x0 < dirty.x1)? binner_state(device) : -1;
+	bin->resolve_rect = dirty;
+	binner_prepass(bin);
+	bin->device = device;
+	job_init(&job, binner_tiles_job, bin, 0, bin->tiles_x * bin->tiles_y, 1);
+	sched_run(&bin->sched, &job);
+	for (i = bin->tiles_x * bin->tiles_y - 1; i >= 0; i--) 
+		bin->tiles[i].count = 0;
+	bin->direct.count = 0;
+	bin->cmd_count = 0;
+	bin->state_count = 0;
+	bin->stage_count = 0;
+}
+
+// 设置渲染线程数：0 为立即模式，N >= 1 为分块模式（含调用线程共 N 个线程），
+// 几何阶段和分块光栅化共用这些线程
+void device_set_threads(device_t *device, int threads) {
+	binner_t *bin = device->binner;
+	int i;
+	if (bin != NULL) {
+		device_flush(device);
+		sched_destroy(&bin->sched);
+		for (i = bin->tiles_x * bin->tiles_y - 1; i >= 0; i--) 
+			free((void*)bin->tiles[i].cmds);
+		for (i = 0; i < bin->stage_capacity; i++) 
+			stage_destroy(&bin->stages[i]);
+		stage_destroy(&bin->direct);
+		for (i = 0; i < bin->sched.threads; i++) 
+			free(bin->scratch[i].vcache);
+		free(bin->tiles);
+		free(bin->states);
+		free(bin->depth_states);
+		free(bin->stages);
+		free(bin->scratch);
+		free(bin);
+		device->binner = NULL;
+	}
+	if (threads <= 0) return;
+	bin = (binner_t*)malloc(sizeof(binner_t));
+	assert(bin);
+	memset(bin, 0, sizeof(binner_t));
+	bin->tiles_x = (device->width + TILE_SIZE - 1) / TILE_SIZE;
+	bin->tiles_y = (device->height + TILE_SIZE - 1) / TILE_SIZE;
+	bin->tiles = (bin_tile_t*)calloc(bin->tiles_x * bin->tiles_y, sizeof(bin_tile_t));
+	bin->scratch = (bin_scratch_t*)calloc(threads, sizeof(bin_scratch_t));
+	assert(bin->tiles && bin->scratch);
+	sched_init(&bin->sched, threads);
+	device->binner = bin;
+}
+
+static void appdata_init(appdata *a, const vertex_t *v) {
+	a->pos = v->pos;
+	a->color = v->color;
+	a->normal = v->normal;
+	a->tex = v->tc;
+}
+
+// 顶点阶段：顶点着色器，cvv 检查，在相机前方时归一化得到屏幕坐标
+static void device_vertex_stage(device_t *device, const shader_t *shader, 
+	const vertex_t *v, vertex_post_t *o) {
+	appdata a;
+	appdata_init(&a, v);
+	shader->vertex(device, &a, &o->out);
+	o->cvv = transform_check_cvv(&o->out.pos);
+	if (o->out.pos.w > 0.0f) 
+		transform_homogenize(&device->transform, &o->screen, &o->out.pos);
+}
+
+#define VERTEX_BATCH        64		// 批量顶点阶段每次转置成 SoA 的顶点数
+
+// 默认顶点着色器的批量版本：转置成 SoA 后用 transform_batch 处理 n 个顶点
+static void device_vertex_batch(device_t *device, const vertex_t *v, int n, vertex_post_t *o) {
+	float buffer[17][VERTEX_BATCH];
+	vector_soa_t pos, normal, clip, world, wnormal, screen;
+	int cvv[VERTEX_BATCH];
+	int base, i, count;
+	pos.x = buffer[0], pos.y = buffer[1], pos.z = buffer[2], pos.w = buffer[3];
+	normal.x = buffer[4], normal.y = buffer[5], normal.z = buffer[6], normal.w = NULL;
+	clip.x = buffer[7], clip.y = buffer[8], clip.z = buffer[9], clip.w = buffer[10];
+	world.x = buffer[11], world.y = buffer[12], world.z = buffer[13], world.w = NULL;
+	wnormal.x = buffer[4], wnormal.y = buffer[5], wnormal.z = buffer[6], wnormal.w = NULL;
+	screen.x = buffer[14], screen.y = buffer[15], screen.z = buffer[16], screen.w = NULL;
+	for (base = 0; base < n; base += VERTEX_BATCH) {
+		count = min(n - base, VERTEX_BATCH);
+		for (i = 0; i < count; i++) {
+			const vertex_t *s = &v[base + i];
+			pos.x[i] = s->pos.x, pos.y[i] = s->pos.y, pos.z[i] = s->pos.z, pos.w[i] = s->pos.w;
+			normal.x[i] = s->normal.x, normal.y[i] = s->normal.y, normal.z[i] = s->normal.z;
+		}
+		transform_batch(&device->transform, count, &pos, &normal, &clip, &world, &wnormal, &screen, cvv);
+		for (i = 0; i < count; i++) {
+			const vertex_t *s = &v[base + i];
+			vertex_post_t *d = &o[base + i];
+			d->out.pos.x = clip.x[i], d->out.pos.y = clip.y[i];
+			d->out.pos.z = clip.z[i], d->out.pos.w = clip.w[i];
+			d->out.wpos.x = world.x[i], d->out.wpos.y = world.y[i];
+			d->out.wpos.z = world.z[i], d->out.wpos.w = 1.0f;
+			d->out.normal.x = wnormal.x[i], d->out.normal.y = wnormal.y[i];
+			d->out.normal.z = wnormal.z[i], d->out.normal.w = 0.0f;
+			d->out.tex = s->tc;
+			d->out.color = s->color;
+			d->cvv = cvv[i];
+			d->screen.x = screen.x[i], d->screen.y = screen.y[i];
+			d->screen.z = screen.z[i], d->screen.w = 1.0f;
+		}
+	}
+}
+
+// 三角形所覆盖像素 rhw 的上界：顶点的最大值再加上一个像素的梯度，
+// 包括像素中心略微落在边外的像素和插值的舍入误差
+static float triangle_rhw_bound(const vertex_t *t1, const vertex_t *t2, const vertex_t *t3) {
+	float dx1 = t2->pos.x - t1->pos.x, dy1 = t2->pos.y - t1->pos.y;
+	float dx2 = t3->pos.x - t1->pos.x, dy2 = t3->pos.y - t1->pos.y;
+	float area = dx1 * dy2 - dx2 * dy1;
+	float z = max(max(t1->rhw, t2->rhw), t3->rhw);
+	if (area != 0.0f) {
+		float d1 = t2->rhw - t1->rhw, d2 = t3->rhw - t1->rhw;
+		z += (float)((fabs(d1 * dy2 - d2 * dy1) + fabs(d2 * dx1 - d1 * dx2)) / fabs(area));
+	}
+	return z + z * 1e-5f;
+}
+
+// 填充已归一化的三角形
+static void device_fill_triangle(device_t *device, const vertex_post_t *v1, 
+	const vertex_post_t *v2, const vertex_post_t *v3) {
+	const point_t *p1 = &v1->screen, *p2 = &v2->screen, *p3 = &v3->screen;
+	int render_state = device->render_state;
+	vertex_t t1, t2, t3;
+	rect_t clip = { 0, 0, device->width, device->height };
+	trapezoid_t traps[2];
+	int n, x0, y0, x1, y1;
+
+	vertex_init_v2f(&t1, &v1->out, p1);	// 初始化 w
+	vertex_init_v2f(&t2, &v2->out, p2);
+	vertex_init_v2f(&t3, &v3->out, p3);
+
+	x0 = max((int)floor(min(min(p1->x, p2->x), p3->x)), 0);
+	y0 = max((int)floor(min(min(p1->y, p2->y), p3->y)), 0);
+	x1 = min((int)ceil(max(max(p1->x, p2->x), p3->x)) + 1, device->width);
+	y1 = min((int)ceil(max(max(p1->y, p2->y), p3->y)) + 1, device->height);
+	if (x0 >= x1 || y0 >= y1) return;		// 三角形在保护带内但不在屏幕上
+
+	// 整个三角形被遮挡。分块渲染时 Hi-Z 还没有包含尚未 flush 的图元，结果偏保守
+	if (device_hiz_occluded(device, x0, y0, x1, y1, triangle_rhw_bound(&t1, &t2, &t3))) return;
+
+	if ((render_state & (RENDER_STATE_DEFERRED | RENDER_STATE_DEPTH)) == RENDER_STATE_DEFERRED) {	// 扩大等待光照的范围
+		rect_t *dirty = &device->gbuffer_dirty;
+		device_gbuffer_init(device);
+		if (dirty->x0 >= dirty->x1) {
+			dirty->x0 = x0, dirty->y0 = y0, dirty->x1 = x1, dirty->y1 = y1;
+		}	else {
+			dirty->x0 = min(dirty->x0, x0), dirty->y0 = min(dirty->y0, y0);
+			dirty->x1 = max(dirty->x1, x1), dirty->y1 = max(dirty->y1, y1);
+		}
+	}
+	
+	if (device->rasterizer == RASTER_HALFSPACE) {
+		halfspace_t hs;
+		if (halfspace_init(&hs, &t1, &t2, &t3) == 0) {
+			// 退化三角形
+		}	else if (device->binner) {
+			binner_add_halfspace(device, &hs);
+		}	else {
+			device_render_halfspace(device, &hs, &clip);
+		}
+	}	else {
+		// 拆分三角形为0-2个梯形，并且返回可用梯形数量
+		n = trapezoid_init_triangle(traps, &t1, &t2, &t3);
+
+		if (device->binner) {
+			if (n >= 1) binner_add_trap(device, &traps[0]);
+			if (n >= 2) binner_add_trap(device, &traps[1]);
+		}	else {
+			if (n >= 1) device_render_trap(device, &traps[0], &clip);
+			if (n >= 2) device_render_trap(device, &traps[1], &clip);
+		}
+	}
+}
+
+// 线框绘制一条边
+static void device_draw_edge(device_t *device, const point_t *p1, const point_t *p2) {
+	if (device->binner) 
+		binner_add_line(device, (int)p1->x, (int)p1->y, (int)p2->x, (int)p2->y, device->foreground);
+	else 
+		device_draw_line(device, (int)p1->x, (int)p1->y, (int)p2->x, (int)p2->y, device->foreground);
+}
+
+#define GUARD_BAND          4.0f	// 保护带：|x|, |y| <= GUARD_BAND * w 的三角形不做 x, y 裁剪，
+									// 超出屏幕的部分由光栅化的屏幕矩形去掉
+#define CLIP_MAX            12		// 三角形被 6 个面裁剪后最多 9 个顶点
+
+// 顶点在齐次空间中相对近、远平面和保护带的位置，返回所在外侧的面，位同 transform_check_cvv
+static int clip_outcode(const vector_t *v) {
+	float g = GUARD_BAND * v->w;
+	int check = 0;
+	if (v->z < 0.0f) check |= 1;
+	if (v->z > v->w) check |= 2;
+	if (v->x < -g) check |= 4;
+	if (v->x >  g) check |= 8;
+	if (v->y < -g) check |= 16;
+	if (v->y >  g) check |= 32;
+	return check;
+}
+
+// 顶点到裁剪面 plane 的有向距离，内侧为正
+static float clip_distance(const vector_t *v, int plane) {
+	switch (plane) {
+	case 0: return v->z;
+	case 1: return v->w - v->z;
+	case 2: return v->x + GUARD_BAND * v->w;
+	case 3: return GUARD_BAND * v->w - v->x;
+	case 4: return v->y + GUARD_BAND * v->w;
+	default: return GUARD_BAND * v->w - v->y;
+	}
+}
+
+// 在齐次空间中用 planes 所示的裁剪面依次裁剪多边形（Sutherland-Hodgman），
+// 顶点属性在裁剪空间线性插值；poly 既是输入也是输出，返回裁剪后的顶点数
+static int clip_polygon(v2f *poly, int n, int planes) {
+	v2f temp[CLIP_MAX], *src = poly, *dst = temp;
+	int plane, i, k;
+	for (plane = 0; plane < 6 && n >= 3; plane++) {
+		int count = 0;
+		if ((planes & (1 << plane)) == 0) continue;
+		for (i = 0; i < n; i++) {
+			const v2f *a = &src[i], *b = &src[(i + 1) % n];
+			float da = clip_distance(&a->pos, plane), db = clip_distance(&b->pos, plane);
+			if (da >= 0.0f) dst[count++] = *a;
+			if ((da >= 0.0f) != (db >= 0.0f)) {	// 边穿过裁剪面
+				const float *fa = (const float*)a, *fb = (const float*)b;
+				float *f = (float*)&dst[count++], t = da / (da - db);
+				for (k = 0; k < (int)(sizeof(v2f) / sizeof(float)); k++) 
+					f[k] = interp(fa[k], fb[k], t);
+			}
+		}
+		n = count;
+		src = dst, dst = (dst == temp)? poly : temp;
+	}
+	if (src != poly) memcpy(poly, src, sizeof(v2f) * n);
+	return n;
+}
+
+// 根据 render_state 绘制经过顶点阶段的三角形
+static void device_draw_triangle(device_t *device, const vertex_post_t *v1, 
+	const vertex_post_t *v2, const vertex_post_t *v3) {
+	const point_t *c1 = &v1->out.pos, *c2 = &v2->out.pos, *c3 = &v3->out.pos;
+	int render_state = device->render_state;
+	int fill = (render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR | RENDER_STATE_DEPTH)) || device->shader;
+	int planes, n, i;
+	vertex_post_t post[CLIP_MAX];
+	v2f poly[CLIP_MAX];
+	float det;
+
+	// 整个三角形在某个 cvv 面外侧
+	if ((v1->cvv & v2->cvv & v3->cvv) != 0) return;
+
+	// 背面剔除：齐次坐标 (x, y, w) 的行列式，顶点在相机后方时同样成立
+	det = c1->x * (c2->y * c3->w - c3->y * c2->w) - 
+		c2->x * (c1->y * c3->w - c3->y * c1->w) + 
+		c3->x * (c1->y * c2->w - c2->y * c1->w);
+	if (det <= 0.0f) return;
+
+	// 全部顶点在近远平面之间、保护带之内时直接光栅化
+	planes = clip_outcode(c1) | clip_outcode(c2) | clip_outcode(c3);
+	if (planes == 0) {
+		if (fill) device_fill_triangle(device, v1, v2, v3);
+		if (render_state & RENDER_STATE_WIREFRAME) {
+			device_draw_edge(device, &v1->screen, &v2->screen);
+			device_draw_edge(device, &v1->screen, &v3->screen);
+			device_draw_edge(device, &v3->screen, &v2->screen);
+		}
+		return;
+	}
+
+	// 在齐次空间裁剪成凸多边形，再按扇形拆分成三角形
+	poly[0] = v1->out, poly[1] = v2->out, poly[2] = v3->out;
+	n = clip_polygon(poly, 3, planes);
+	if (n < 3) return;
+	for (i = 0; i < n; i++) {
+		post[i].out = poly[i];
+		post[i].cvv = 0;
+		transform_homogenize(&device->transform, &post[i].screen, &poly[i].pos);
+	}
+	if (fill) {
+		for (i = 1; i + 1 < n; i++) 
+			device_fill_triangle(device, &post[0], &post[i], &post[i + 1]);
+	}
+	if (render_state & RENDER_STATE_WIREFRAME) {
+		for (i = 0; i < n; i++) 
+			device_draw_edge(device, &post[i].screen, &post[(i + 1) % n].screen);
+	}
+}
+
+// 绘制一个三角形
 void device_draw_primitive(device_t *device, const vertex_t *v1, 
 	const vertex_t *v2, const vertex_t *v3) {
-	point_t p1, p2, p3, c1, c2, c3;
+	const shader_t *shader = device_shader(device);
+	vertex_post_t o1, o2, o3;
+	transform_prepare(&device->transform);
+	device_vertex_stage(device, shader, v1, &o1);
+	device_vertex_stage(device, shader, v2, &o2);
+	device_vertex_stage(device, shader, v3, &o3);
+	device_draw_triangle(device, &o1, &o2, &o3);
+}
+
+// 可以并行处理几何的调度器：分块模式、多于一个线程，并且不是在暂存区中设置图元
+static sched_t *device_sched(const device_t *device) {
+	if (device->binner == NULL || device->stage != NULL) return NULL;
+	if (device->binner->sched.threads <= 1) return NULL;
+	return &device->binner->sched;
+}
+
+// n 个顶点经过顶点阶段，结果写入 o
+static void device_vertex_range(device_t *device, const shader_t *shader, 
+	const vertex_t *v, int n, vertex_post_t *o) {
+	int i;
+	if (shader->vertex == vertex_shader_default) {	// 默认顶点着色器可以批量处理
+		device_vertex_batch(device, v, n, o);
+	}	else {
+		for (i = 0; i < n; i++) 
+			device_vertex_stage(device, shader, &v[i], &o[i]);
+	}
+}
+
+typedef struct {
+	device_t *device;
+	const shader_t *shader;
+	const vertex_t *vertices;
+	vertex_post_t *cache;
+}	vertex_job_t;
+
+static void device_vertex_job(void *arg, int begin, int end, int thread) {
+	vertex_job_t *vj = (vertex_job_t*)arg;
+	(void)thread;
+	device_vertex_range(vj->device, vj->shader, vj->vertices + begin, end - begin, vj->cache + begin);
+}
+
+// 准备 nverts 个顶点的 vcache，返回后 vj 描述的顶点阶段可以在任意线程执行
+static void device_vertex_alloc(device_t *device, vertex_job_t *vj, const shader_t *shader, 
+	const vertex_t *vertices, int nverts) {
+	transform_prepare(&device->transform);
+	if (nverts > device->vcache_size) {
+		if (device->vcache) free(device->vcache);
+		device->vcache = (vertex_post_t*)malloc(sizeof(vertex_post_t) * nverts);
+		assert(device->vcache);
+		device->vcache_size = nverts;
+	}
+	vj->device = device;
+	vj->shader = shader;
+	vj->vertices = vertices;
+	vj->cache = device->vcache;
+}
+
+// 所有顶点经过一次顶点阶段，结果写入 vcache；顶点多时按 VERTEX_BATCH 分批并行
+static vertex_post_t *device_vertex_cache(device_t *device, const shader_t *shader, 
+	const vertex_t *vertices, int nverts) {
+	sched_t *sched = device_sched(device);
+	vertex_job_t vj;
+	job_t job;
+	device_vertex_alloc(device, &vj, shader, vertices, nverts);
+	if (sched != NULL && nverts >= VERTEX_BATCH * 4) {
+		job_init(&job, device_vertex_job, &vj, 0, nverts, VERTEX_BATCH);
+		sched_run(sched, &job);
+	}	else {
+		device_vertex_range(device, shader, vertices, nverts, vj.cache);
+	}
+	return vj.cache;
+}
+
+// 按索引从顶点缓存组装三角形
+static void device_draw_cached(device_t *device, const vertex_post_t *cache, int nverts, 
+	const int *indices, int count) {
+	int i;
+	for (i = 0; i + 2 < count; i += 3) {
+		int a = indices[i], b = indices[i + 1], c = indices[i + 2];
+		assert(a >= 0 && a < nverts && b >= 0 && b < nverts && c >= 0 && c < nverts);
+		device_draw_triangle(device, &cache[a], &cache[b], &cache[c]);
+	}
+}
+
+#define SETUP_CHUNK         256		// 并行设置时每段的三角形数，分段与线程数无关
+
+typedef void (*draw_item_t)(device_t *device, void *arg, int index);
+
+typedef struct {
+	device_t *device;
+	draw_item_t draw;
+	void *arg;
+	int count;                  // 绘制项数
+	int grain;                  // 每段的项数
+	int first;                  // 第一段使用的暂存区
+}	draw_items_t;
+
+static void device_items_job(void *arg, int begin, int end, int thread) {
+	draw_items_t *items = (draw_items_t*)arg;
+	binner_t *bin = items->device->binner;
+	bin_scratch_t *scratch = &bin->scratch[thread];
+	int segment;
+	for (segment = begin; segment < end; segment++) {
+		bin_stage_t *stage = &bin->stages[items->first + segment];
+		device_t local = *items->device;
+		int i = segment * items->grain, last = min(i + items->grain, items->count);
+		stage->count = stage->state_count = 0;
+		local.stage = stage;
+		local.vcache = scratch->vcache;
+		local.vcache_size = scratch->vcache_size;
+		for (; i < last; i++) items->draw(&local, items->arg, i);
+		scratch->vcache = local.vcache;
+		scratch->vcache_size = local.vcache_size;
+		stage->dirty = local.gbuffer_dirty;
+	}
+}
+
+// 依次绘制 count 项。可以并行时每 grain 项为一段，各段在设备的副本上设置图元，
+// 写入各自的暂存区，before 非 NULL 时在它完成之后开始；最后按段的顺序登记到块中
+static void device_draw_items(device_t *device, job_t *before, draw_item_t draw, 
+	void *arg, int count, int grain) {
+	sched_t *sched = device_sched(device);
+	binner_t *bin = device->binner;
+	rect_t *dirty = &device->gbuffer_dirty;
+	int segments = (count + grain - 1) / grain, i;
+	draw_items_t items;
+	job_t job;
+	if (sched == NULL || segments < 2) {
+		if (before) sched_run(&bin->sched, before);
+		for (i = 0; i < count; i++) draw(device, arg, i);
+		return;
+	}
+	if ((device->render_state & (RENDER_STATE_DEFERRED | RENDER_STATE_DEPTH)) == RENDER_STATE_DEFERRED) 
+		device_gbuffer_init(device);	// 各副本共用法线缓存
+	if (bin->stage_count + segments > bin->stage_capacity) {	// 暂存的命令保留到 flush，各次绘制使用不同的暂存区
+		int capacity = max(bin->stage_count + segments, bin->stage_capacity * 2);
+		bin->stages = (bin_stage_t*)realloc(bin->stages, sizeof(bin_stage_t) * capacity);
+		assert(bin->stages);
+		memset(bin->stages + bin->stage_capacity, 0, 
+			sizeof(bin_stage_t) * (capacity - bin->stage_capacity));
+		bin->stage_capacity = capacity;
+	}
+	items.device = device;
+	items.draw = draw;
+	items.arg = arg;
+	items.count = count;
+	items.grain = grain;
+	items.first = bin->stage_count;
+	bin->stage_count += segments;
+	job_init(&job, device_items_job, &items, 0, segments, 1);
+	if (before) {
+		job_after(&job, before);
+		sched_submit(sched, 0, before);
+		sched_wait(sched, &job);
+	}	else {
+		sched_run(sched, &job);
+	}
+	for (i = items.first; i < bin->stage_count; i++) {
+		const rect_t *d = &bin->stages[i].dirty;
+		binner_merge(device, &bin->stages[i]);
+		if (d->x0 >= d->x1) continue;
+		if (dirty->x0 >= dirty->x1) {
+			*dirty = *d;
+		}	else {
+			dirty->x0 = min(dirty->x0, d->x0), dirty->y0 = min(dirty->y0, d->y0);
+			dirty->x1 = max(dirty->x1, d->x1), dirty->y1 = max(dirty->y1, d->y1);
+		}
+	}
+}
+
+typedef struct {
+	const vertex_post_t *cache;
+	int nverts;
+	const int *indices;
+}	triangles_t;
+
+static void device_triangle_item(device_t *device, void *arg, int index) {
+	const triangles_t *t = (const triangles_t*)arg;
+	int a = t->indices[index * 3], b = t->indices[index * 3 + 1], c = t->indices[index * 3 + 2];
+	assert(a >= 0 && a < t->nverts && b >= 0 && b < t->nverts && c >= 0 && c < t->nverts);
+	device_draw_triangle(device, &t->cache[a], &t->cache[b], &t->cache[c]);
+}
+
+// 绘制索引三角形列表，count 为索引个数：每个顶点只经过一次顶点阶段，
+// 结果缓存在 vcache 中，再按索引组装三角形。三角形多时顶点阶段和
+// 三角形设置都分段并行，设置任务依赖顶点任务
+void device_draw_indexed(device_t *device, const vertex_t *vertices, int nverts, 
+	const int *indices, int count) {
+	const shader_t *shader = device_shader(device);
+	vertex_job_t vj;
+	triangles_t tris;
+	job_t job;
+	if (device_sched(device) == NULL || count / 3 < SETUP_CHUNK * 2) {
+		vertex_post_t *cache = device_vertex_cache(device, shader, vertices, nverts);
+		device_draw_cached(device, cache, nverts, indices, count);
+		return;
+	}
+	device_vertex_alloc(device, &vj, shader, vertices, nverts);
+	job_init(&job, device_vertex_job, &vj, 0, nverts, VERTEX_BATCH);
+	tris.cache = vj.cache;
+	tris.nverts = nverts;
+	tris.indices = indices;
+	device_draw_items(device, &job, device_triangle_item, &tris, count / 3, SETUP_CHUNK);
+}
+
+typedef struct {
+	const shader_t *shader;
+	const vertex_t *vertices;
+	int nverts;
+	const int *indices;
+	int count;
+	const matrix_t *worlds;
+	const color_t *colors;
+}	instances_t;
+
+static void device_instance_item(device_t *device, void *arg, int index) {
+	const instances_t *in = (const instances_t*)arg;
+	vertex_post_t *cache;
+	int j;
+	transform_set_world(&device->transform, &in->worlds[index]);
+	cache = device_vertex_cache(device, in->shader, in->vertices, in->nverts);
+	for (j = 0; in->colors && j < in->nverts; j++) {
+		cache[j].out.color.r *= in->colors[index].r;
+		cache[j].out.color.g *= in->colors[index].g;
+		cache[j].out.color.b *= in->colors[index].b;
+	}
+	device_draw_cached(device, cache, in->nverts, in->indices, in->count);
+}
+
+// 实例化绘制：同一网格按 worlds[i] 绘制 instances 次，colors 非 NULL 时用 colors[i] 调制
+// 顶点阶段输出的颜色。着色器选择等每次绘制的设置只做一次，每个实例只用 transform_set_world
+// 合成矩阵；实例按约 SETUP_CHUNK 个三角形一段并行设置。结束后恢复原来的 world
+void device_draw_instanced(device_t *device, const vertex_t *vertices, int nverts, 
+	const int *indices, int count, const matrix_t *worlds, const color_t *colors, int instances) {
+	matrix_t world = device->transform.world;
+	instances_t in;
+	in.shader = device_shader(device);
+	in.vertices = vertices;
+	in.nverts = nverts;
+	in.indices = indices;
+	in.count = count;
+	in.worlds = worlds;
+	in.colors = colors;
+	device_draw_items(device, NULL, device_instance_item, &in, instances, 
+		max(SETUP_CHUNK * 3 / max(count, 1), 1));
+	transform_set_world(&device->transform, &world);
+}
+
+
+//=====================================================================
+// 场景：物体按世界空间包围盒组织成 BVH，绘制前整棵子树和整个物体
+// 先与视锥比较，视锥外的物体不做任何顶点处理
+//=====================================================================
+typedef struct { vector_t min, max; } aabb_t;
+typedef struct { vector_t planes[6]; } frustum_t;	// 平面 (a, b, c, d)，内侧 ax + by + cz + d >= 0
+
+#define FRUSTUM_ALL         63		// 六个面都需要测试
+#define BVH_LEAF            4		// 叶子最多包含的物体数
+#define BVH_STACK           64		// 遍历栈：中位数划分的深度不超过 log2(物体数)，栈最多深度 + 1 项
+
+typedef struct {
+	const vertex_t *vertices;   // 顶点、索引由调用者持有
+	int nverts;
+	const int *indices;
+	int count;
+	matrix_t world;             // 世界坐标变换
+	const texture_t *texture;   // 物体的纹理，NULL 时使用设备当前纹理
+	aabb_t box;                 // 世界空间包围盒
+	vector_t center;            // 世界空间包围球
+	float radius;
+}	scene_object_t;
+
+typedef struct {
+	aabb_t box;
+	int right;                  // 右子节点，左子节点紧跟在本节点之后
+	int first, count;           // 叶子包含 order[first, first + count)，内部节点 count 为 0
+}	bvh_node_t;
+
+typedef struct {
+	scene_object_t *objects;
+	int count, capacity;
+	int *order;                 // 按 BVH 叶子排列的物体下标
+	bvh_node_t *nodes;
+	int node_count;
+	int dirty;                  // 增加物体后需要重建 BVH
+}	scene_t;
+
+// 由 m 提取视锥的六个面：裁剪空间 clip = p * m，cvv 为 -w <= x, y <= w，0 <= z <= w
+void frustum_from_matrix(frustum_t *f, const matrix_t *m) {
+	int i;
+	for (i = 0; i < 4; i++) {
+		float x = m->m[i][0], y = m->m[i][1], z = m->m[i][2], w = m->m[i][3];
+		(&f->planes[0].x)[i] = w + x;	// 左
+		(&f->planes[1].x)[i] = w - x;	// 右
+		(&f->planes[2].x)[i] = w + y;	// 下
+		(&f->planes[3].x)[i] = w - y;	// 上
+		(&f->planes[4].x)[i] = z;		// 近
+		(&f->planes[5].x)[i] = w - z;	// 远
+	}
+	for (i = 0; i < 6; i++) {	// 单位化法线，使平面方程等于有向距离
+		vector_t *p = &f->planes[i];
+		float len = (float)sqrt(p->x * p->x + p->y * p->y + p->z * p->z);
+		if (len > 0) p->x /= len, p->y /= len, p->z /= len, p->w /= len;
+	}
+}
+
+// 包围盒在 mask 中某个面的外侧时返回 -1，否则返回包围盒仍与之相交的面，0 表示完全在视锥内
+int frustum_test_aabb(const frustum_t *f, const aabb_t *box, int mask) {
+	int i;
+	for (i = 0; i < 6; i++) {
+		const vector_t *p = &f->planes[i];
+		float far, near;
+		if ((mask & (1 << i)) == 0) continue;
+		far = p->w + p->x * ((p->x >= 0)? box->max.x : box->min.x) + 
+			p->y * ((p->y >= 0)? box->max.y : box->min.y) + 
+			p->z * ((p->z >= 0)? box->max.z : box->min.z);
+		if (far < 0) return -1;
+		near = p->w + p->x * ((p->x >= 0)? box->min.x : box->max.x) + 
+			p->y * ((p->y >= 0)? box->min.y : box->max.y) + 
+			p->z * ((p->z >= 0)? box->min.z : box->max.z);
+		if (near >= 0) mask &= ~(1 << i);
+	}
+	return mask;
+}
+
+// 包围球版本，返回值同 frustum_test_aabb
+int frustum_test_sphere(const frustum_t *f, const vector_t *center, float radius, int mask) {
+	int i;
+	for (i = 0; i < 6; i++) {
+		const vector_t *p = &f->planes[i];
+		float d;
+		if ((mask & (1 << i)) == 0) continue;
+		d = p->x * center->x + p->y * center->y + p->z * center->z + p->w;
+		if (d < -radius) return -1;
+		if (d >= radius) mask &= ~(1 << i);
+	}
+	return mask;
+}
+
+static void aabb_empty(aabb_t *box) {
+	box->min.x = box->min.y = box->min.z = 1e30f;
+	box->max.x = box->max.y = box->max.z = -1e30f;
+	box->min.w = box->max.w = 1.0f;
+}
+
+static void aabb_add_point(aabb_t *box, const vector_t *p) {
+	if (p->x < box->min.x) box->min.x = p->x;
+	if (p->y < box->min.y) box->min.y = p->y;
+	if (p->z < box->min.z) box->min.z = p->z;
+	if (p->x > box->max.x) box->max.x = p->x;
+	if (p->y > box->max.y) box->max.y = p->y;
+	if (p->z > box->max.z) box->max.z = p->z;
+}
+
+static void aabb_merge(aabb_t *box, const aabb_t *other) {
+	aabb_add_point(box, &other->min);
+	aabb_add_point(box, &other->max);
+}
+
+void scene_init(scene_t *scene) {
+	memset(scene, 0, sizeof(scene_t));
+}
+
+void scene_destroy(scene_t *scene) {
+	if (scene->objects) free(scene->objects);
+	if (scene->order) free(scene->order);
+	if (scene->nodes) free(scene->nodes);
+	memset(scene, 0, sizeof(scene_t));
+}
+
+// 增加一个物体（索引三角形列表），返回物体下标；包围体由模型空间包围盒的八个角变换得到
+int scene_add(scene_t *scene, const vertex_t *vertices, int nverts, 
+	const int *indices, int count, const matrix_t *world) {
+	scene_object_t *obj;
+	aabb_t local;
+	int i;
+	if (scene->count >= scene->capacity) {
+		scene->capacity = scene->capacity * 2 + 16;
+		scene->objects = (scene_object_t*)realloc(scene->objects, 
+			sizeof(scene_object_t) * scene->capacity);
+		assert(scene->objects);
+	}
+	obj = &scene->objects[scene->count];
+	obj->vertices = vertices;
+	obj->nverts = nverts;
+	obj->indices = indices;
+	obj->count = count;
+	obj->world = *world;
+	obj->texture = NULL;
+	aabb_empty(&local);
+	for (i = 0; i < nverts; i++) 
+		aabb_add_point(&local, &vertices[i].pos);
+	aabb_empty(&obj->box);
+	for (i = 0; i < 8; i++) {
+		vector_t corner, p;
+		corner.x = (i & 1)? local.max.x : local.min.x;
+		corner.y = (i & 2)? local.max.y : local.min.y;
+		corner.z = (i & 4)? local.max.z : local.min.z;
+		corner.w = 1.0f;
+		matrix_apply(&p, &corner, world);
+		aabb_add_point(&obj->box, &p);
+	}
+	vector_interp(&obj->center, &obj->box.min, &obj->box.max, 0.5f);
+	obj->center.w = 1.0f;
+	obj->radius = 0.5f * (float)sqrt(
+		(obj->box.max.x - obj->box.min.x) * (obj->box.max.x - obj->box.min.x) + 
+		(obj->box.max.y - obj->box.min.y) * (obj->box.max.y - obj->box.min.y) + 
+		(obj->box.max.z - obj->box.min.z) * (obj->box.max.z - obj->box.min.z));
+	scene->dirty = 1;
+	return scene->count++;
+}
+
+// 部分排序 order[first, first + count)，使第 k 个物体的中心在 axis 上位于中位，左侧不大于、右侧不小于它
+static void bvh_select(scene_t *scene, int first, int count, int k, int axis) {
+	int *order = scene->order;
+	int lo = first, hi = first + count - 1;
+	k += first;
+	while (lo < hi) {
+		float pivot = (&scene->objects[order[(lo + hi) / 2]].center.x)[axis];
+		int i = lo, j = hi;
+		while (i <= j) {
+			while ((&scene->objects[order[i]].center.x)[axis] < pivot) i++;
+			while ((&scene->objects[order[j]].center.x)[axis] > pivot) j--;
+			if (i <= j) {
+				int t = order[i];
+				order[i++] = order[j];
+				order[j--] = t;
+			}
+		}
+		if (k <= j) hi = j;
+		else if (k >= i) lo = i;
+		else break;
+	}
+}
+
+// 为 order[first, first + count) 建立子树，按中心跨度最大的轴在中位数处分开，返回节点下标
+static int bvh_build(scene_t *scene, int first, int count) {
+	int index = scene->node_count++;
+	bvh_node_t *node = &scene->nodes[index];
+	aabb_t centers;
+	int i, axis, half;
+	aabb_empty(&node->box);
+	aabb_empty(&centers);
+	for (i = first; i < first + count; i++) {
+		const scene_object_t *obj = &scene->objects[scene->order[i]];
+		aabb_merge(&node->box, &obj->box);
+		aabb_add_point(&centers, &obj->center);
+	}
+	node->first = first;
+	node->count = count;
+	node->right = -1;
+	if (count <= BVH_LEAF) return index;
+	axis = 0;
+	if (centers.max.y - centers.min.y > centers.max.x - centers.min.x) axis = 1;
+	if (centers.max.z - centers.min.z > (&centers.max.x)[axis] - (&centers.min.x)[axis]) axis = 2;
+	half = count / 2;
+	bvh_select(scene, first, count, half, axis);
+	node->count = 0;
+	bvh_build(scene, first, half);
+	node->right = bvh_build(scene, first + half, count - half);	// nodes 预先分配，node 一直有效
+	return index;
+}
+
+// 重建 BVH，scene_draw 在增加物体后自动调用
+void scene_build(scene_t *scene) {
+	int i;
+	if (scene->order) free(scene->order);
+	if (scene->nodes) free(scene->nodes);
+	scene->order = NULL;
+	scene->nodes = NULL;
+	scene->node_count = 0;
+	scene->dirty = 0;
+	if (scene->count == 0) return;
+	scene->order = (int*)malloc(sizeof(int) * scene->count);
+	scene->nodes = (bvh_node_t*)malloc(sizeof(bvh_node_t) * scene->count * 2);
+	assert(scene->order && scene->nodes);
+	for (i = 0; i < scene->count; i++) scene->order[i] = i;
+	bvh_build(scene, 0, scene->count);
+}
+
+// 绘制与视锥相交的物体，返回绘制的物体数；完全在视锥内的子树不再测试
+typedef struct {
+	const scene_t *scene;
+	const int *visible;         // 通过视锥测试的物体
+	const texture_t *texture;   // 物体没有纹理时使用的纹理
+}	scene_items_t;
+
+static void scene_object_item(device_t *device, void *arg, int index) {
+	const scene_items_t *items = (const scene_items_t*)arg;
+	const scene_object_t *obj = &items->scene->objects[items->visible[index]];
+	transform_set_world(&device->transform, &obj->world);
+	device->texture = (obj->texture != NULL)? obj->texture : items->texture;
+	device_draw_indexed(device, obj->vertices, obj->nverts, obj->indices, obj->count);
+}
+
+// 先遍历 BVH 收集视锥内的物体，再按平均约 SETUP_CHUNK 个三角形一段绘制；
+// 返回绘制的物体数
+int scene_draw(device_t *device, scene_t *scene) {
+	int stack[BVH_STACK], masks[BVH_STACK];
+	matrix_t world = device->transform.world;
+	scene_items_t items;
+	frustum_t frustum;
+	int *visible;
+	int top = 0, drawn = 0, indices = 0;
+	if (scene->dirty) scene_build(scene);
+	if (scene->node_count == 0) return 0;
+	visible = (int*)malloc(sizeof(int) * scene->count);
+	assert(visible);
+	frustum_from_matrix(&frustum, transform_vp(&device->transform));
+	stack[top] = 0, masks[top++] = FRUSTUM_ALL;
+	while (top > 0) {
+		const bvh_node_t *node = &scene->nodes[stack[--top]];
+		int mask = frustum_test_aabb(&frustum, &node->box, masks[top]);
+		int i;
+		if (mask < 0) continue;
+		if (node->count == 0) {
+			assert(top + 2 <= BVH_STACK);
+			stack[top] = node->right, masks[top++] = mask;
+			stack[top] = (int)(node - scene->nodes) + 1, masks[top++] = mask;
+			continue;
+		}
+		for (i = node->first; i < node->first + node->count; i++) {
+			const scene_object_t *obj = &scene->objects[scene->order[i]];
+			if (mask && frustum_test_sphere(&frustum, &obj->center, obj->radius, mask) < 0) continue;
+			if (mask && frustum_test_aabb(&frustum, &obj->box, mask) < 0) continue;
+			visible[drawn++] = scene->order[i];
+			indices += obj->count;
+		}
+	}
+	items.scene = scene;
+	items.visible = visible;
+	items.texture = device->texture;
+	if (drawn > 0) 
+		device_draw_items(device, NULL, scene_object_item, &items, drawn, 
+			max((int)((double)SETUP_CHUNK * 3 * drawn / max(indices, 1)), 1));
+	free(visible);
+	transform_set_world(&device->transform, &world);
+	device->texture = items.texture;
+	return drawn;
+}
+
+
+//=====================================================================
+// 命令缓冲：记录绘制调用（网格、变换、纹理、状态），不访问设备，多个线程
+// 可以各自记录一个缓冲；提交时按状态、纹理排序，同样状态的由近到远绘制，
+// 减少被覆盖的像素，再经 device_draw_items 分段并行回放
+//=====================================================================
+typedef struct {
+	const vertex_t *vertices;   // 顶点、索引由调用者持有，提交完成前保持有效
+	int nverts;
+	const int *indices;
+	int count;
+	matrix_t world;
+	const texture_t *texture;   // NULL 时使用设备当前纹理
+	const shader_t *shader;
+	int render_state;
+	vector_t center;            // 世界空间包围盒中心，提交时由它计算深度
+}	draw_cmd_t;
+
+typedef struct {
+	draw_cmd_t *cmds;
+	int count, capacity;
+	int render_state;           // 之后记录的绘制使用的状态、着色器和纹理
+	const shader_t *shader;
+	const texture_t *texture;
+}	cmdbuf_t;
+
+void cmdbuf_init(cmdbuf_t *cb, int render_state) {
+	memset(cb, 0, sizeof(cmdbuf_t));
+	cb->render_state = render_state;
+}
+
+void cmdbuf_destroy(cmdbuf_t *cb) {
+	if (cb->cmds) free(cb->cmds);
+	memset(cb, 0, sizeof(cmdbuf_t));
+}
+
+// 清空已记录的绘制，保留当前状态
+void cmdbuf_reset(cmdbuf_t *cb) {
+	cb->count = 0;
+}
+
+// 设置之后记录的绘制使用的状态、着色器和纹理，已记录的绘制不受影响
+void cmdbuf_set_state(cmdbuf_t *cb, int render_state) {
+	cb->render_state = render_state;
+}
+
+void cmdbuf_set_shader(cmdbuf_t *cb, const shader_t *shader) {
+	cb->shader = shader;
+}
+
+// NULL 时使用提交时设备的纹理
+void cmdbuf_set_texture(cmdbuf_t *cb, const texture_t *texture) {
+	cb->texture = texture;
+}
+
+// 记录一次索引三角形列表的绘制，使用缓冲当前的状态、着色器和纹理
+void cmdbuf_draw(cmdbuf_t *cb, const vertex_t *vertices, int nverts, 
+	const int *indices, int count, const matrix_t *world) {
+	draw_cmd_t *cmd;
+	aabb_t local;
+	int i;
+	if (cb->count >= cb->capacity) {
+		cb->capacity = cb->capacity * 2 + 16;
+		cb->cmds = (draw_cmd_t*)realloc(cb->cmds, sizeof(draw_cmd_t) * cb->capacity);
+		assert(cb->cmds);
+	}
+	cmd = &cb->cmds[cb->count++];
+	cmd->vertices = vertices;
+	cmd->nverts = nverts;
+	cmd->indices = indices;
+	cmd->count = count;
+	cmd->world = *world;
+	cmd->texture = cb->texture;
+	cmd->shader = cb->shader;
+	cmd->render_state = cb->render_state;
+	aabb_empty(&local);
+	for (i = 0; i < nverts; i++) 
+		aabb_add_point(&local, &vertices[i].pos);
+	cmd->center.x = (local.min.x + local.max.x) * 0.5f;
+	cmd->center.y = (local.min.y + local.max.y) * 0.5f;
+	cmd->center.z = (local.min.z + local.max.z) * 0.5f;
+	cmd->center.w = 1.0f;
+	matrix_apply(&cmd->center, &cmd->center, world);
+}
+
+// 提交时每个绘制的排序键，命令缓冲本身只读，可以同时提交给多个设备
+typedef struct {
+	const draw_cmd_t *cmd;
+	float depth;                // 由 center 计算的视空间深度
+	int order;                  // 提交时的序号，排序键都相同时保持记录顺序
+}	draw_key_t;
+
+// 排序键：状态、着色器、纹理，然后由近到远
+static int draw_key_compare(const void *x, const void *y) {
+	const draw_key_t *ka = (const draw_key_t*)x, *kb = (const draw_key_t*)y;
+	const draw_cmd_t *a = ka->cmd, *b = kb->cmd;
+	if (a->render_state != b->render_state) return (a->render_state < b->render_state)? -1 : 1;
+	if (a->shader != b->shader) return ((size_t)a->shader < (size_t)b->shader)? -1 : 1;
+	if (a->texture != b->texture) return ((size_t)a->texture < (size_t)b->texture)? -1 : 1;
+	if (ka->depth != kb->depth) return (ka->depth < kb->depth)? -1 : 1;
+	return ka->order - kb->order;
+}
+
+typedef struct {
+	draw_key_t *keys;           // 排序后的绘制
+	const texture_t *texture;   // 提交前设备的纹理
+}	submit_items_t;
+
+static void device_cmd_item(device_t *device, void *arg, int index) {
+	const submit_items_t *items = (const submit_items_t*)arg;
+	const draw_cmd_t *cmd = items->keys[index].cmd;
+	device->render_state = cmd->render_state;
+	device->shader = cmd->shader;
+	device->texture = (cmd->texture != NULL)? cmd->texture : items->texture;
+	transform_set_world(&device->transform, &cmd->world);
+	device_draw_indexed(device, cmd->vertices, cmd->nverts, cmd->indices, cmd->count);
+}
+
+// 按顺序收集 count 个缓冲中的绘制，排序后绘制，返回绘制数；
+// 设备的状态、着色器、纹理和 world 在返回前恢复
+int device_submit(device_t *device, const cmdbuf_t * const *buffers, int count) {
+	const matrix_t *view = &device->transform.view;
+	matrix_t world = device->transform.world;
 	int render_state = device->render_state;
+	const shader_t *shader = device->shader;
+	submit_items_t items;
+	int total = 0, indices = 0, i, j;
+	for (i = 0; i < count; i++) total += buffers[i]->count;
+	if (total == 0) return 0;
+	items.keys = (draw_key_t*)malloc(sizeof(draw_key_t) * total);
+	items.texture = device->texture;
+	assert(items.keys);
+	for (i = 0, total = 0; i < count; i++) {
+		for (j = 0; j < buffers[i]->count; j++) {
+			const draw_cmd_t *cmd = &buffers[i]->cmds[j];
+			const vector_t *c = &cmd->center;
+			draw_key_t *key = &items.keys[total];
+			key->cmd = cmd;
+			key->depth = c->x * view->m[0][2] + c->y * view->m[1][2] + c->z * view->m[2][2] + view->m[3][2];
+			key->order = total++;
+			if ((cmd->render_state & (RENDER_STATE_DEFERRED | RENDER_STATE_DEPTH)) == RENDER_STATE_DEFERRED) 
+				device_gbuffer_init(device);	// 并行回放的各副本共用法线缓存
+			indices += cmd->count;
+		}
+	}
+	qsort(items.keys, total, sizeof(draw_key_t), draw_key_compare);
+	device_draw_items(device, NULL, device_cmd_item, &items, total, 
+		max((int)((double)SETUP_CHUNK * 3 * total / max(indices, 1)), 1));
+	free(items.keys);
+	device->render_state = render_state;
+	device->shader = shader;
+	device->texture = items.texture;
+	transform_set_world(&device->transform, &world);
+	return total;
+}
 
-	// 按照 Transform 变化
-	transform_apply(&device->transform, &c1, &v1->pos);
-	transform_apply(&device->transform, &c2, &v2->pos);
-	transform_apply(&device->transform, &c3, &v3->pos);
-
-	// 背面剔除
-	vector_t v12, v13;
-	vector_sub(&v12, &c2, &c1);
-	vector_sub(&v13, &c3, &c1);
-	if (v12.y * v13.x - v13.y * v12.x >= 0) return;
-
-	// 裁剪，注意此处可以完善为具体判断几个点在 cvv内以及同cvv相交平面的坐标比�
-	// 进行进一步精细裁剪，将一个分解为几个完全处在 cvv内的三角�
-	if (transform_check_cvv(&c1) != 0) return;
-	if (transform_check_cvv(&c2) != 0) return;
-	if (transform_check_cvv(&c3) != 0) return;
-
-	// 归一�
-	transform_homogenize(&device->transform, &p1, &c1);
-	transform_homogenize(&device->transform, &p2, &c2);
-	transform_homogenize(&device->transform, &p3, &c3);
-
-	// 纹理或者色彩绘�
-	if (render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR)) {
-		vertex_t t1 = *v1, t2 = *v2, t3 = *v3;
-		trapezoid_t traps[2];
-		int n;
-
-		t1.pos = p1; 
-		t2.pos = p2;
-		t3.pos = p3;
-		t1.pos.w = c1.w;
-		t2.pos.w = c2.w;
-
-		t3.pos.w = c3.w;
-		
-		//法向量变换
-		matrix_t inverse;
-		matrix_inverse(&inverse, &device->transform.world);
-		matrix_transpose(&inverse);
-		vertex_normal_transform(&t1, &inverse);
-		vertex_normal_transform(&t2, &inverse);
-		vertex_normal_transform(&t3, &inverse);
-
-
-		vertex_rhw_init(&t1);	// 初始�w
-		vertex_rhw_init(&t2);	// 初始�w
-		vertex_rhw_init(&t3);	// 初始�w
-		
-		// 拆分三角形为0-2个梯形，并且返回可用梯形数量
-		n = trapezoid_init_triangle(traps, &t1, &t2, &t3);
 
-		if (n >= 1) device_render_trap(device, &traps[0]);
-		if (n >= 2) device_render_trap(device, &traps[1]);
+//=====================================================================
+// 离屏渲染目标：与平台无关，帧缓存由调用者持有，用于服务器批量渲染
+//=====================================================================
+typedef struct {
+	int width;                  // 宽度
+	int height;                 // 高度
+	long pitch;                 // 每行字节数
+	IUINT32 *bits;              // 像素：0x00RRGGBB，内存顺序 BGRA
+	int owned;                  // bits 是否由 offscreen_init 分配
+}	offscreen_t;
+
+// 初始化离屏目标，fb 为 NULL 时自行分配；之后用 device_init(..., os->bits)
+int offscreen_init(offscreen_t *os, int w, int h, void *fb) {
+	os->width = w;
+	os->height = h;
+	os->pitch = w * 4;
+	os->owned = (fb == NULL)? 1 : 0;
+	os->bits = (fb != NULL)? (IUINT32*)fb : (IUINT32*)malloc(w * h * 4);
+	if (os->bits == NULL) return -1;
+	if (os->owned) memset(os->bits, 0, w * h * 4);
+	return 0;
+}
+
+void offscreen_destroy(offscreen_t *os) {
+	if (os->owned && os->bits) free(os->bits);
+	os->bits = NULL;
+	os->owned = 0;
+}
+
+// 输出为二进制 PPM (P6)
+int offscreen_save_ppm(const offscreen_t *os, const char *filename) {
+	FILE *fp = fopen(filename, "wb");
+	unsigned char *line;
+	int x, y, hr = 0;
+	if (fp == NULL) return -1;
+	line = (unsigned char*)malloc(os->width * 3);
+	if (line == NULL) {
+		fclose(fp);
+		return -1;
 	}
+	if (fprintf(fp, "P6\n%d %d\n255\n", os->width, os->height) < 0) hr = -1;
+	for (y = 0; y < os->height && hr == 0; y++) {
+		const IUINT32 *src = (const IUINT32*)((const char*)os->bits + os->pitch * y);
+		for (x = 0; x < os->width; x++) {
+			line[x * 3 + 0] = (unsigned char)(src[x] >> 16);
+			line[x * 3 + 1] = (unsigned char)(src[x] >> 8);
+			line[x * 3 + 2] = (unsigned char)(src[x]);
+		}
+		if (fwrite(line, 1, os->width * 3, fp) != (size_t)(os->width * 3)) hr = -1;
+	}
+	free(line);
+	if (fclose(fp) != 0) hr = -1;	// 缓冲区里的数据在这里才真正写出
+	return hr;
+}
 
-	if (render_state & RENDER_STATE_WIREFRAME) {		// 线框绘制
-		device_draw_line(device, (int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, device->foreground);
-		device_draw_line(device, (int)p1.x, (int)p1.y, (int)p3.x, (int)p3.y, device->foreground);
-		device_draw_line(device, (int)p3.x, (int)p3.y, (int)p2.x, (int)p2.y, device->foreground);
+// CRC 表由调用者持有，多个线程可以同时保存图片
+static void png_crc_init(IUINT32 *table) {
+	int i, k;
+	for (i = 0; i < 256; i++) {
+		IUINT32 c = (IUINT32)i;
+		for (k = 0; k < 8; k++) c = (c & 1)? 0xedb88320u ^ (c >> 1) : c >> 1;
+		table[i] = c;
 	}
 }
 
+static IUINT32 png_crc(const IUINT32 *table, IUINT32 crc, const unsigned char *data, int size) {
+	int i;
+	for (i = 0; i < size; i++) 
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void png_put32(unsigned char *p, IUINT32 x) {
+	p[0] = (unsigned char)(x >> 24);
+	p[1] = (unsigned char)(x >> 16);
+	p[2] = (unsigned char)(x >> 8);
+	p[3] = (unsigned char)(x);
+}
+
+static void png_chunk(FILE *fp, const char *type, const unsigned char *data, int size) {
+	unsigned char head[8], tail[4];
+	IUINT32 table[256], crc;
+	png_crc_init(table);
+	png_put32(head, (IUINT32)size);
+	memcpy(head + 4, type, 4);
+	crc = png_crc(table, 0xffffffffu, head + 4, 4);
+	crc = png_crc(table, crc, data, size);
+	png_put32(tail, crc ^ 0xffffffffu);
+	fwrite(head, 1, 8, fp);
+	if (size > 0) fwrite(data, 1, size, fp);
+	fwrite(tail, 1, 4, fp);
+}
+
+// 输出为 PNG：不依赖 zlib，IDAT 使用 deflate 的不压缩块 (stored block)
+int offscreen_save_png(const offscreen_t *os, const char *filename) {
+	static const unsigned char sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	int stride = os->width * 3 + 1;
+	int raw_size = stride * os->height;
+	int blocks = (raw_size + 65534) / 65535;
+	int idat_size = 2 + raw_size + blocks * 5 + 4;
+	unsigned char *raw, *idat, *dst, ihdr[13];
+	IUINT32 a = 1, b = 0;
+	int x, y, pos;
+	FILE *fp;
+	raw = (unsigned char*)malloc(raw_size);
+	idat = (unsigned char*)malloc(idat_size);
+	if (raw == NULL || idat == NULL) {
+		free(raw);
+		free(idat);
+		return -1;
+	}
+	for (y = 0; y < os->height; y++) {
+		const IUINT32 *src = (const IUINT32*)((const char*)os->bits + os->pitch * y);
+		unsigned char *line = raw + stride * y;
+		line[0] = 0;	// filter: none
+		for (x = 0; x < os->width; x++) {
+			line[1 + x * 3 + 0] = (unsigned char)(src[x] >> 16);
+			line[1 + x * 3 + 1] = (unsigned char)(src[x] >> 8);
+			line[1 + x * 3 + 2] = (unsigned char)(src[x]);
+		}
+	}
+	dst = idat;
+	*dst++ = 0x78;		// zlib header: deflate, 32K window
+	*dst++ = 0x01;
+	for (pos = 0; pos < raw_size; ) {
+		int size = raw_size - pos;
+		if (size > 65535) size = 65535;
+		*dst++ = (pos + size >= raw_size)? 1 : 0;
+		*dst++ = (unsigned char)(size & 0xff);
+		*dst++ = (unsigned char)(size >> 8);
+		*dst++ = (unsigned char)(~size & 0xff);
+		*dst++ = (unsigned char)((~size >> 8) & 0xff);
+		memcpy(dst, raw + pos, size);
+		dst += size;
+		pos += size;
+	}
+	for (pos = 0; pos < raw_size; pos++) {	// adler32
+		a = (a + raw[pos]) % 65521;
+		b = (b + a) % 65521;
+	}
+	png_put32(dst, (b << 16) | a);
+	png_put32(ihdr, (IUINT32)os->width);
+	png_put32(ihdr + 4, (IUINT32)os->height);
+	ihdr[8] = 8;		// bit depth
+	ihdr[9] = 2;		// color type: RGB
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	fp = fopen(filename, "wb");
+	if (fp != NULL) {
+		fwrite(sig, 1, 8, fp);
+		png_chunk(fp, "IHDR", ihdr, 13);
+		png_chunk(fp, "IDAT", idat, idat_size);
+		png_chunk(fp, "IEND", NULL, 0);
+		fclose(fp);
+	}
+	free(raw);
+	free(idat);
+	return (fp != NULL)? 0 : -1;
+}
+
+// 根据扩展名选择格式：.png 输出 PNG，其余输出 PPM
+int offscreen_save(const offscreen_t *os, const char *filename) {
+	size_t n = strlen(filename);
+	if (n >= 4 && strcmp(filename + n - 4, ".png") == 0)
+		return offscreen_save_png(os, filename);
+	return offscreen_save_ppm(os, filename);
+}
+
+// 高精度计时，单位秒
+double timer_seconds(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
 
+//=====================================================================
+// 交换链：几个颜色缓存轮流使用，显示线程处理第 N 帧的同时渲染第 N+1 帧
+//=====================================================================
+#define SWAP_MAX    4
+
+// 显示一帧，由显示线程按帧号顺序调用；返回非 0 表示失败，之后的帧不再显示
+typedef int (*present_proc_t)(void *user, const IUINT32 *bits, int frame);
+
+typedef struct {
+	IUINT32 *buffers[SWAP_MAX];
+	int count;                  // 缓存个数，1 时在 swapchain_present 里同步显示
+	int owned;                  // 缓存是否由 swapchain_init 分配
+	present_proc_t proc;
+	void *user;
+	int queued;                 // 已提交的帧数
+	int presented;              // 已显示完的帧数
+	int failed;                 // 第一个显示失败的帧号，没有时为 -1
+	int quit;
+	int threaded;
+	thread_t thread;
+	mutex_t lock;
+	cond_t cond;                // 提交、显示完成和退出都在这里通知
+}	swapchain_t;
+
+static void swapchain_thread(void *arg) {
+	swapchain_t *sc = (swapchain_t*)arg;
+	int frame, skip, hr;
+	mutex_lock(&sc->lock);
+	while (1) {
+		while (sc->presented == sc->queued && sc->quit == 0) 
+			cond_wait(&sc->cond, &sc->lock);
+		if (sc->presented == sc->queued) break;
+		frame = sc->presented;
+		skip = (sc->failed >= 0);
+		mutex_unlock(&sc->lock);
+		hr = skip? 0 : sc->proc(sc->user, sc->buffers[frame % sc->count], frame);
+		mutex_lock(&sc->lock);
+		if (hr != 0) sc->failed = frame;
+		sc->presented++;
+		cond_broadcast(&sc->cond);
+	}
+	mutex_unlock(&sc->lock);
+}
+
+// 初始化 count 个 w x h 的缓存，fb 非 NULL 时使用外部连续存放的 count 帧；
+// proc 为 NULL 时只轮换缓存，count 为 1 或线程创建失败时同步显示
+int swapchain_init(swapchain_t *sc, int w, int h, int count, void *fb, 
+	present_proc_t proc, void *user) {
+	int i;
+	memset(sc, 0, sizeof(swapchain_t));
+	count = max(1, min(count, SWAP_MAX));
+	sc->count = count;
+	sc->owned = (fb == NULL)? 1 : 0;
+	sc->proc = proc;
+	sc->user = user;
+	sc->failed = -1;
+	if (fb == NULL) fb = malloc((size_t)w * h * 4 * count);
+	if (fb == NULL) return -1;
+	for (i = 0; i < count; i++) 
+		sc->buffers[i] = (IUINT32*)fb + (size_t)w * h * i;
+	if (sc->owned) memset(fb, 0, (size_t)w * h * 4 * count);
+	mutex_init(&sc->lock);
+	cond_init(&sc->cond);
+	if (count > 1 && proc != NULL) 
+		sc->threaded = (thread_create(&sc->thread, swapchain_thread, sc) == 0)? 1 : 0;
+	return 0;
+}
+
+// 取得下一帧要渲染的缓存，所有缓存都在等待显示时阻塞；显示失败后返回 NULL
+IUINT32 *swapchain_acquire(swapchain_t *sc) {
+	IUINT32 *bits;
+	mutex_lock(&sc->lock);
+	while (sc->queued - sc->presented >= sc->count && sc->failed < 0) 
+		cond_wait(&sc->cond, &sc->lock);
+	bits = (sc->failed < 0)? sc->buffers[sc->queued % sc->count] : NULL;
+	mutex_unlock(&sc->lock);
+	return bits;
+}
+
+// 提交 swapchain_acquire 取得的缓存，渲染完成后调用
+void swapchain_present(swapchain_t *sc) {
+	int frame = sc->queued;
+	if (sc->threaded == 0) {
+		int hr = (sc->proc != NULL && sc->failed < 0)? 
+			sc->proc(sc->user, sc->buffers[frame % sc->count], frame) : 0;
+		if (hr != 0) sc->failed = frame;
+		sc->queued++;
+		sc->presented++;
+		return;
+	}
+	mutex_lock(&sc->lock);
+	sc->queued++;
+	cond_broadcast(&sc->cond);
+	mutex_unlock(&sc->lock);
+}
+
+// 等待已提交的帧全部显示完，返回成功显示的帧数
+int swapchain_wait(swapchain_t *sc) {
+	int done;
+	mutex_lock(&sc->lock);
+	while (sc->presented < sc->queued) cond_wait(&sc->cond, &sc->lock);
+	done = (sc->failed < 0)? sc->presented : sc->failed;
+	mutex_unlock(&sc->lock);
+	return done;
+}
+
+void swapchain_destroy(swapchain_t *sc) {
+	swapchain_wait(sc);
+	if (sc->threaded) {
+		mutex_lock(&sc->lock);
+		sc->quit = 1;
+		cond_broadcast(&sc->cond);
+		mutex_unlock(&sc->lock);
+		thread_join(&sc->thread);
+		sc->threaded = 0;
+	}
+	mutex_destroy(&sc->lock);
+	cond_destroy(&sc->cond);
+	if (sc->owned && sc->buffers[0]) free(sc->buffers[0]);
+	memset(sc->buffers, 0, sizeof(sc->buffers));
+}
+
+
+//=====================================================================
+// 视频流：每帧直接从帧缓存写出原始 BGRA 或 Y4M，作为交换链的显示函数，
+// 管道写满时阻塞显示线程，渲染最多领先交换链的缓存个数帧
+//=====================================================================
+#define STREAM_BGRA     0		// 原始 BGRA，A 为 0，如 ffmpeg -f rawvideo -pix_fmt bgr0
+#define STREAM_Y4M      1		// YUV4MPEG2，BT.601 limited range 4:2:0
+
+typedef struct {
+	FILE *fp;
+	int owned;                  // fp 是否由 stream_open 打开
+	int format;
+	int width, height;
+	unsigned char *yuv;         // Y4M 一帧的 Y、U、V 平面
+}	stream_t;
+
+// BT.601 limited range，Y 为单个像素，U、V 为 2x2 像素之和，取整方式和 SSE2 一致
+#define STREAM_Y(r, g, b)   ((66 * (r) + 129 * (g) + 25 * (b) + (16 << 8) + 128) >> 8)
+#define STREAM_U(r, g, b)   ((-38 * (r) - 74 * (g) + 112 * (b) + (128 << 10) + 512) >> 10)
+#define STREAM_V(r, g, b)   ((112 * (r) - 94 * (g) - 18 * (b) + (128 << 10) + 512) >> 10)
+
+// 两行像素从 x 开始转为两行 Y 和一行 U、V，宽度为奇数时最后一列重复
+static void stream_yuv_rows(const IUINT32 *row0, const IUINT32 *row1, unsigned char *y0, 
+	unsigned char *y1, unsigned char *u, unsigned char *v, int x, int w) {
+	for (; x < w; x += 2) {
+		int x1 = min(x + 1, w - 1), r = 0, g = 0, b = 0, i;
+		IUINT32 c[4];
+		c[0] = row0[x], c[1] = row0[x1], c[2] = row1[x], c[3] = row1[x1];
+		for (i = 0; i < 4; i++) {
+			int cr = (c[i] >> 16) & 255, cg = (c[i] >> 8) & 255, cb = c[i] & 255;
+			unsigned char *dst = (i < 2)? y0 : y1;
+			dst[(i & 1)? x1 : x] = (unsigned char)STREAM_Y(cr, cg, cb);
+			r += cr, g += cg, b += cb;
+		}
+		u[x >> 1] = (unsigned char)STREAM_U(r, g, b);
+		v[x >> 1] = (unsigned char)STREAM_V(r, g, b);
+	}
+}
+
+#ifdef MINI3D_SSE2
+// 4 个像素和系数 k 的点积，lo、hi 各有两个 16 位 BGRA 像素
+static __m128i stream_dot4(__m128i lo, __m128i hi, __m128i k) {
+	__m128 s0 = _mm_castsi128_ps(_mm_madd_epi16(lo, k));
+	__m128 s1 = _mm_castsi128_ps(_mm_madd_epi16(hi, k));
+	__m128i even = _mm_castps_si128(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(2, 0, 2, 0)));
+	__m128i odd = _mm_castps_si128(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(3, 1, 3, 1)));
+	return _mm_add_epi32(even, odd);
+}
+
+// 两行各 8 个像素转为 2 x 8 个 Y 和 4 个 U、V
+static void stream_yuv_sse2(const IUINT32 *row0, const IUINT32 *row1, unsigned char *y0, 
+	unsigned char *y1, unsigned char *u, unsigned char *v) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ky = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+	const __m128i ku = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+	const __m128i kv = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+	const __m128i by = _mm_set1_epi32((16 << 8) + 128);
+	const __m128i bc = _mm_set1_epi32((128 << 10) + 512);
+	__m128i a[4], b[4], c[4], t0, t1;
+	int i, cu, cv;
+	for (i = 0; i < 2; i++) {
+		t0 = _mm_loadu_si128((const __m128i*)(row0 + i * 4));
+		t1 = _mm_loadu_si128((const __m128i*)(row1 + i * 4));
+		a[i * 2] = _mm_unpacklo_epi8(t0, zero), a[i * 2 + 1] = _mm_unpackhi_epi8(t0, zero);
+		b[i * 2] = _mm_unpacklo_epi8(t1, zero), b[i * 2 + 1] = _mm_unpackhi_epi8(t1, zero);
+	}
+	t0 = _mm_srli_epi32(_mm_add_epi32(stream_dot4(a[0], a[1], ky), by), 8);
+	t1 = _mm_srli_epi32(_mm_add_epi32(stream_dot4(a[2], a[3], ky), by), 8);
+	_mm_storel_epi64((__m128i*)y0, _mm_packus_epi16(_mm_packs_epi32(t0, t1), zero));
+	t0 = _mm_srli_epi32(_mm_add_epi32(stream_dot4(b[0], b[1], ky), by), 8);
+	t1 = _mm_srli_epi32(_mm_add_epi32(stream_dot4(b[2], b[3], ky), by), 8);
+	_mm_storel_epi64((__m128i*)y1, _mm_packus_epi16(_mm_packs_epi32(t0, t1), zero));
+	for (i = 0; i < 4; i++) {
+		c[i] = _mm_add_epi16(a[i], b[i]);
+		c[i] = _mm_add_epi16(c[i], _mm_srli_si128(c[i], 8));	// 低 64 位为 2x2 之和
+	}
+	t0 = _mm_unpacklo_epi64(c[0], c[1]);
+	t1 = _mm_unpacklo_epi64(c[2], c[3]);
+	c[0] = _mm_srli_epi32(_mm_add_epi32(stream_dot4(t0, t1, ku), bc), 10);
+	c[1] = _mm_srli_epi32(_mm_add_epi32(stream_dot4(t0, t1, kv), bc), 10);
+	c[0] = _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), zero);
+	cu = _mm_cvtsi128_si32(c[0]);
+	cv = _mm_cvtsi128_si32(_mm_srli_si128(c[0], 4));
+	memcpy(u, &cu, 4);
+	memcpy(v, &cv, 4);
+}
+#endif
+
+// 帧缓存转为 I420 的三个平面，高度为奇数时最后一行重复
+static void stream_yuv420(const stream_t *st, const IUINT32 *bits, long pitch) {
+	int w = st->width, h = st->height, cw = (w + 1) / 2, ch = (h + 1) / 2;
+	unsigned char *yp = st->yuv, *up = yp + w * h, *vp = up + cw * ch;
+	int x, j;
+	for (j = 0; j < h; j += 2) {
+		const IUINT32 *row0 = (const IUINT32*)((const char*)bits + pitch * j);
+		const IUINT32 *row1 = (j + 1 < h)? (const IUINT32*)((const char*)row0 + pitch) : row0;
+		unsigned char *y0 = yp + w * j, *y1 = (j + 1 < h)? y0 + w : y0;
+		unsigned char *u = up + cw * (j >> 1), *v = vp + cw * (j >> 1);
+		x = 0;
+#ifdef MINI3D_SSE2
+		for (; x + 8 <= w; x += 8) 
+			stream_yuv_sse2(row0 + x, row1 + x, y0 + x, y1 + x, u + (x >> 1), v + (x >> 1));
+#endif
+		stream_yuv_rows(row0, row1, y0, y1, u, v, x, w);
+	}
+}
+
+// 打开视频流，filename 为 "-" 时写到标准输出；Y4M 在这里写文件头
+int stream_open(stream_t *st, const char *filename, int format, int w, int h, int fps) {
+	memset(st, 0, sizeof(stream_t));
+	st->format = format;
+	st->width = w;
+	st->height = h;
+	if (strcmp(filename, "-") == 0) {
+		st->fp = stdout;
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}	else {
+		st->fp = fopen(filename, "wb");
+		st->owned = 1;
+	}
+	if (st->fp == NULL) return -1;
+	if (format == STREAM_Y4M) {
+		st->yuv = (unsigned char*)malloc(w * h + ((w + 1) / 2) * ((h + 1) / 2) * 2);
+		if (st->yuv == NULL) return -2;
+		fprintf(st->fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", w, h, fps);
+	}
+	return 0;
+}
+
+void stream_close(stream_t *st) {
+	if (st->fp && st->owned) fclose(st->fp);
+	else if (st->fp) fflush(st->fp);
+	if (st->yuv) free(st->yuv);
+	st->fp = NULL;
+	st->yuv = NULL;
+}
+
+// 写出一帧，BGRA 在行连续时一次写出整帧；写不下时返回 -1
+int stream_write(stream_t *st, const IUINT32 *bits, long pitch) {
+	int w = st->width, h = st->height, j;
+	if (st->format == STREAM_Y4M) {
+		size_t size = w * h + ((w + 1) / 2) * ((h + 1) / 2) * 2;
+		stream_yuv420(st, bits, pitch);
+		fputs("FRAME\n", st->fp);
+		if (fwrite(st->yuv, 1, size, st->fp) != size) return -1;
+	}	
+	else if (pitch == w * 4) {
+		if (fwrite(bits, 4, (size_t)w * h, st->fp) != (size_t)w * h) return -1;
+	}
+	else {
+		for (j = 0; j < h; j++) {
+			if (fwrite((const char*)bits + pitch * j, 4, w, st->fp) != (size_t)w) return -1;
+		}
+	}
+	return 0;
+}
+
+
+#ifndef MINI3D_HEADLESS
 //=====================================================================
 // Win32 窗口及图形绘制：�device 提供一�DibSection �FB
 //=====================================================================
@@ -1096,10 +4393,12 @@ static HBITMAP screen_ob = NULL;		// 老的 BITMAP
 unsigned char *screen_fb = NULL;		// frame buffer
 long screen_pitch = 0;
 
+#define SCREEN_BUFFERS  2		// DIB 中上下排列的帧数，交给交换链轮流使用
+
 int screen_init(int w, int h, const TCHAR *title);	// 屏幕初始�
 int screen_close(void);								// 关闭屏幕
 void screen_dispatch(void);							// 处理消息
-void screen_update(void);							// 显示 FrameBuffer
+void screen_present(int index);						// 显示第 index 帧，不处理消息
 
 // win32 event handler
 static LRESULT screen_events(HWND, UINT, WPARAM, LPARAM);	
@@ -1113,8 +4412,8 @@ static LRESULT screen_events(HWND, UINT, WPARAM, LPARAM);
 int screen_init(int w, int h, const TCHAR *title) {
 	WNDCLASS wc = { CS_BYTEALIGNCLIENT, (WNDPROC)screen_events, 0, 0, 0, 
 		NULL, NULL, NULL, NULL, _T("SCREEN3.1415926") };
-	BITMAPINFO bi = { { sizeof(BITMAPINFOHEADER), w, -h, 1, 32, BI_RGB, 
-		w * h * 4, 0, 0, 0, 0 }  };
+	BITMAPINFO bi = { { sizeof(BITMAPINFOHEADER), w, -h * SCREEN_BUFFERS, 1, 32, BI_RGB, 
+		w * h * 4 * SCREEN_BUFFERS, 0, 0, 0, 0 }  };
 	RECT rect = { 0, 0, w, h };
 	int wx, wy, sx, sy;
 	LPVOID ptr;
@@ -1159,7 +4458,7 @@ int screen_init(int w, int h, const TCHAR *title) {
 	screen_dispatch();
 
 	memset(screen_keys, 0, sizeof(int) * 512);
-	memset(screen_fb, 0, w * h * 4);
+	memset(screen_fb, 0, w * h * 4 * SCREEN_BUFFERS);
 
 	return 0;
 }
@@ -1204,71 +4503,433 @@ void screen_dispatch(void) {
 	}
 }
 
-void screen_update(void) {
+// 可以在显示线程调用，消息仍由创建窗口的线程处理
+void screen_present(int index) {
 	HDC hDC = GetDC(screen_handle);
-	BitBlt(hDC, 0, 0, screen_w, screen_h, screen_dc, 0, 0, SRCCOPY);
+	BitBlt(hDC, 0, 0, screen_w, screen_h, screen_dc, 0, screen_h * index, SRCCOPY);
 	ReleaseDC(screen_handle, hDC);
-	screen_dispatch();
 }
 
+static int screen_present_proc(void *user, const IUINT32 *bits, int frame) {
+	(void)user, (void)frame;
+	screen_present((int)(((const unsigned char*)bits - screen_fb) / (screen_pitch * screen_h)));
+	return 0;
+}
+
+#endif	// MINI3D_HEADLESS
+
 
 //=====================================================================
 // 主程�
 //=====================================================================
 vertex_t mesh[8] = {
 	//front
-	{ { 1,  1,  1, 1 },{ 0, 1 },{ 1.0f, 0.2f, 1.0f },{ 1,0,0 },1 },
-	{ { 1,  1, -1, 1 },{ 0, 0 },{ 0.2f, 1.0f, 0.3f },{ 1,0,0 },1 },
-	{ { 1, -1, -1, 1 },{ 1, 0 },{ 1.0f, 1.0f, 0.2f },{ 1,0,0 }, 1 },
-	{ { 1, -1,  1, 1 }, { 1, 1 }, { 1.0f, 0.2f, 0.2f },{1,0,0}, 1 },
+	{ { 1,  1,  1, 1 },{ 0, 0 },{ 1.0f, 0.2f, 1.0f },{ 1, 0, 0, 0 }, 1, { 0, 0, 0, 1 } },
+	{ { 1,  1, -1, 1 },{ 0, 1 },{ 0.2f, 1.0f, 0.3f },{ 1, 0, 0, 0 }, 1, { 0, 0, 0, 1 } },
+	{ { 1, -1, -1, 1 },{ 1, 1 },{ 1.0f, 1.0f, 0.2f },{ 1, 0, 0, 0 }, 1, { 0, 0, 0, 1 } },
+	{ { 1, -1,  1, 1 }, { 1, 0 }, { 1.0f, 0.2f, 0.2f },{ 1, 0, 0, 0 }, 1, { 0, 0, 0, 1 } },
 	//up
-	{ { 1,  1,  1, 1 },{ 0, 0 },{ 1.0f, 0.2f, 1.0f },{ 0,0,1 },1 },
-	{ { 1,  -1, 1, 1 },{ 1, 0 },{ 0.2f, 1.0f, 0.3f },{ 0,0,1 },1 },
-	{ { -1, -1, 1, 1 },{ 1, 1 },{ 1.0f, 1.0f, 0.2f },{ 0,0,1 }, 1 },
-	{ { -1, 1,  1, 1 },{ 0, 1 },{ 1.0f, 0.2f, 0.2f },{ 0,0,1 }, 1 },
+	{ { 1,  1,  1, 1 },{ 0, 0 },{ 1.0f, 0.2f, 1.0f },{ 0, 0, 1, 0 }, 1, { 0, 0, 0, 1 } },
+	{ { 1,  -1, 1, 1 },{ 0, 1 },{ 0.2f, 1.0f, 0.3f },{ 0, 0, 1, 0 }, 1, { 0, 0, 0, 1 } },
+	{ { -1, -1, 1, 1 },{ 1, 1 },{ 1.0f, 1.0f, 0.2f },{ 0, 0, 1, 0 }, 1, { 0, 0, 0, 1 } },
+	{ { -1, 1,  1, 1 },{ 1, 0 },{ 1.0f, 0.2f, 0.2f },{ 0, 0, 1, 0 }, 1, { 0, 0, 0, 1 } },
 };
 
-void draw_plane(device_t *device, int a, int b, int c, int d) {
-	vertex_t p1 = mesh[a], p2 = mesh[b], p3 = mesh[c], p4 = mesh[d];
-	p1.tc.u = 0, p1.tc.v = 0, p2.tc.u = 0, p2.tc.v = 1;
-	p3.tc.u = 1, p3.tc.v = 1, p4.tc.u = 1, p4.tc.v = 0;
-	device_draw_primitive(device, &p1, &p2, &p3);
-	device_draw_primitive(device, &p3, &p4, &p1);
-}
+// 每个面两个三角形
+int mesh_indices[12] = {
+	0, 1, 2,  2, 3, 0,
+	4, 5, 6,  6, 7, 4,
+};
 
 void draw_box(device_t *device, float theta) {
 	matrix_t m;
 	matrix_set_rotate(&m, 0, 1, 0, theta);
-	device->transform.world = m;
-	transform_update(&device->transform);
-	draw_plane(device, 0, 1, 2, 3);
-	draw_plane(device, 4, 5, 6, 7);
+	transform_set_world(&device->transform, &m);
+	device_draw_indexed(device, mesh, 8, mesh_indices, 12);
 }
 
 void camera_at_zero(device_t *device, float x, float y, float z) {
 	point_t eye = { x, y, z, 1 }, at = { 0, 0, 0, 1 }, up = { 0, 0, 1, 1 };
+	matrix_t view;
 	device->CameraPos.x = 5;
 	device->CameraPos.y = 1;
 	device->CameraPos.z = 2;
-	matrix_set_lookat(&device->transform.view, &eye, &at, &up);
-	transform_update(&device->transform);
+	matrix_set_lookat(&view, &eye, &at, &up);
+	transform_set_view(&device->transform, &view);
 }
 
-void init_texture(device_t *device) {
-	static IUINT32 texture[256][256];
+// 生成 256x256 的棋盘格，由调用者释放
+IUINT32 *checker_bits(void) {
+	IUINT32 *bits = (IUINT32*)malloc(sizeof(IUINT32) * 256 * 256);
 	int i, j;
+	assert(bits);
 	for (j = 0; j < 256; j++) {
 		for (i = 0; i < 256; i++) {
 			int x = i / 32, y = j / 32;
-			texture[j][i] = ((x + y) & 1)? 0xffffff : 0x3fbcef;
+			bits[j * 256 + i] = ((x + y) & 1)? 0xffffff : 0x3fbcef;
 		}
 	}
-	device_set_texture(device, texture, 256 * 4, 256, 256);
+	return bits;
+}
+
+void init_texture(device_t *device) {
+	IUINT32 *bits = checker_bits();
+	device_set_texture(device, bits, 256 * 4, 256, 256);
+	free(bits);
+}
+
+// 在 xy 平面上按网格摆放 count 个立方体的第 i 个，各自绕 z 轴转一个角度
+void grid_matrix(matrix_t *m, int i, int count) {
+	int side = (int)ceil(sqrt((double)count));
+	float x = (float)(i % side - side / 2) * 4.0f;
+	float y = (float)(i / side - side / 2) * 4.0f;
+	matrix_t r, t;
+	matrix_set_rotate(&r, 0, 0, 1, (float)i * 0.7f);
+	matrix_set_translate(&t, x, y, 0);
+	matrix_mul(m, &r, &t);
+}
+
+void init_scene(scene_t *scene, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		matrix_t m;
+		grid_matrix(&m, i, count);
+		scene_add(scene, mesh, 8, mesh_indices, 12, &m);
+	}
+	scene_build(scene);
 }
 
+#ifdef MINI3D_HEADLESS
+
+// 自定义着色器示例：把世界空间法线映射为颜色，不做光照
+static void fragment_normal(const device_t *device, const v2f *in, surface_t *out) {
+	vector_t n = in->normal;
+	(void)device;
+	vector_normalize(&n);
+	out->albedo = ((int)(n.x * 127.0f + 128.0f) << 16) | 
+		((int)(n.y * 127.0f + 128.0f) << 8) | (int)(n.z * 127.0f + 128.0f);
+	out->normal = n;
+}
+
+SHADER_DEFINE(shader_normal, vertex_shader_default, fragment_normal, VARYING_NORMAL, 0)
+
+// 一个渲染作业：自己的设备和交换链，纹理、场景和实例数据只读共享
+typedef struct {
+	device_t device;
+	swapchain_t chain;          // 显示线程写出上一帧的同时渲染下一帧
+	int width, height;
+	const char *output;         // 输出文件名，多个作业时依次代入作业号和帧号
+	stream_t stream;            // 视频流，没有时 stream.fp 为 NULL
+	int job, jobs;
+	int frames;                 // 要渲染的帧数
+	int done;                   // 已完成的帧数
+	scene_t *scene;
+	int objects;
+	const matrix_t *worlds;
+	const color_t *colors;
+	int instances;
+	int commands;               // 每帧录制的命令数，分散到几个命令缓冲
+	cmdbuf_t buffers[4];
+}	render_job_t;
+
+// 把 N 个网格排布的盒子轮流录进各个命令缓冲，录制不碰设备
+static void record_boxes(render_job_t *job) {
+	int i;
+	for (i = 0; i < 4; i++) {
+		cmdbuf_reset(&job->buffers[i]);
+		cmdbuf_set_shader(&job->buffers[i], job->device.shader);
+	}
+	for (i = 0; i < job->commands; i++)
+		cmdbuf_draw(&job->buffers[i & 3], mesh, 8, mesh_indices, 12, &job->worlds[i]);
+}
+
+// 把 pattern 中依次出现的 %d 或 %0Nd 换成 values，%% 为 %，其余字符原样保留；
+// 用户给的文件名不作为 printf 格式串使用
+static void output_name(char *dst, int size, const char *pattern, const int *values, int count) {
+	int n = 0, k = 0;
+	while (*pattern && n < size - 1) {
+		const char *p = pattern + 1;
+		int zero = 0, width = 0;
+		if (pattern[0] == '%' && pattern[1] == '%') {
+			dst[n++] = '%';
+			pattern += 2;
+			continue;
+		}
+		if (pattern[0] == '%' && k < count) {
+			if (*p == '0') zero = 1, p++;
+			while (*p >= '0' && *p <= '9' && width < 100) width = width * 10 + (*p++ - '0');
+			if (*p == 'd') {
+				char num[128];
+				int i;
+				snprintf(num, sizeof(num), zero? "%0*d" : "%*d", width, values[k++]);
+				for (i = 0; num[i] && n < size - 1; i++) dst[n++] = num[i];
+				pattern = p + 1;
+				continue;
+			}
+		}
+		dst[n++] = *pattern++;
+	}
+	dst[n] = 0;
+}
+
+// 显示线程写出一帧图片和视频
+static int render_job_present(void *user, const IUINT32 *bits, int frame) {
+	render_job_t *job = (render_job_t*)user;
+	offscreen_t target;
+	char name[1024];
+	int values[2];
+	if (job->stream.fp && stream_write(&job->stream, bits, job->width * 4) != 0) {
+		fprintf(stderr, "cannot write video frame %d\n", frame);
+		return -1;
+	}
+	if (job->output == NULL) return 0;
+	values[0] = job->job, values[1] = frame;
+	if (job->jobs > 1) output_name(name, sizeof(name), job->output, values, 2);
+	else output_name(name, sizeof(name), job->output, values + 1, 1);
+	offscreen_init(&target, job->width, job->height, (void*)bits);
+	if (offscreen_save(&target, name) != 0) {
+		fprintf(stderr, "cannot write %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+// 释放作业，初始化到一半的作业也可以释放；先等显示线程写完
+static void render_job_destroy(render_job_t *job) {
+	int i;
+	if (job->chain.buffers[0]) swapchain_destroy(&job->chain);
+	stream_close(&job->stream);
+	if (job->device.framebuffer) device_destroy(&job->device);
+	for (i = 0; i < 4; i++) cmdbuf_destroy(&job->buffers[i]);
+}
+
+static void render_job(void *arg) {
+	render_job_t *job = (render_job_t*)arg;
+	device_t *device = &job->device;
+	IUINT32 *bits;
+	const cmdbuf_t *lists[4];
+	float alpha = 0;
+	float pos = 3;
+	int i;
+	for (i = 0; i < 4; i++) lists[i] = &job->buffers[i];
+	for (i = 0; i < job->frames; i++) {
+		bits = swapchain_acquire(&job->chain);
+		if (bits == NULL) break;
+		device_set_framebuffer(device, bits);
+		device_clear(device, 1);
+		camera_at_zero(device, pos, 0, 0);
+		alpha += 0.01f;
+		if (job->objects > 0) scene_draw(device, job->scene);
+		else if (job->instances > 0) 
+			device_draw_instanced(device, mesh, 8, mesh_indices, 12, job->worlds, job->colors, job->instances);
+		else if (job->commands > 0) {
+			record_boxes(job);
+			device_submit(device, lists, 4);
+		}
+		else draw_box(device, alpha);
+		device_flush(device);
+		swapchain_present(&job->chain);
+	}
+	job->done = swapchain_wait(&job->chain);
+}
+
+// 无窗口主循环：全速渲染 N 帧，不 Sleep，可选逐帧输出图片；
+// -j 时每个作业一个设备、一个线程，同时渲染
+int main(int argc, char *argv[])
+{
+	render_job_t *jobs;
+	thread_t *workers;
+	texture_t checker;
+	IUINT32 *bits;
+	const char *output = NULL;
+	const char *video = NULL;
+	int encoding = -1;
+	int width = 800, height = 600;
+	int frames = 100;
+	int threads = 0;
+	int rasterizer = RASTER_TRAPEZOID;
+	int state = RENDER_STATE_TEXTURE;
+	int deferred = 0;
+	int prepass = 0;
+	int depth = DEPTH_FLOAT;
+	int objects = 0;
+	int instances = 0;
+	int commands = 0;
+	int count = 1;
+	int buffers = 2;
+	matrix_t *worlds = NULL;
+	color_t *colors = NULL;
+	scene_t scene;
+	const shader_t *shader = NULL;
+	int sampler = SAMPLER_TRILINEAR;
+	double start, elapsed;
+	int i, k, grid, done, ready;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc)? argv[i + 1] : NULL;
+		if (strcmp(arg, "-n") == 0 && val) frames = atoi(val), i++;
+		else if (strcmp(arg, "-w") == 0 && val) width = atoi(val), i++;
+		else if (strcmp(arg, "-h") == 0 && val) height = atoi(val), i++;
+		else if (strcmp(arg, "-o") == 0 && val) output = val, i++;
+		else if (strcmp(arg, "-v") == 0 && val) video = val, i++;
+		else if (strcmp(arg, "-e") == 0 && val && strcmp(val, "y4m") == 0) 
+			encoding = STREAM_Y4M, i++;
+		else if (strcmp(arg, "-e") == 0 && val && strcmp(val, "bgra") == 0) 
+			encoding = STREAM_BGRA, i++;
+		else if (strcmp(arg, "-j") == 0 && val) count = atoi(val), i++;
+		else if (strcmp(arg, "-p") == 0 && val) buffers = atoi(val), i++;
+		else if (strcmp(arg, "-d") == 0) deferred = RENDER_STATE_DEFERRED;
+		else if (strcmp(arg, "-z") == 0) prepass = RENDER_STATE_ZPREPASS;
+		else if (strcmp(arg, "-g") == 0 && val) objects = atoi(val), i++;
+		else if (strcmp(arg, "-b") == 0 && val && strcmp(val, "float") == 0) 
+			depth = DEPTH_FLOAT, i++;
+		else if (strcmp(arg, "-b") == 0 && val && strcmp(val, "unorm16") == 0) 
+			depth = DEPTH_UNORM16, i++;
+		else if (strcmp(arg, "-b") == 0 && val && strcmp(val, "unorm24") == 0) 
+			depth = DEPTH_UNORM24, i++;
+		else if (strcmp(arg, "-i") == 0 && val) instances = atoi(val), i++;
+		else if (strcmp(arg, "-c") == 0 && val) commands = atoi(val), i++;
+		else if (strcmp(arg, "-r") == 0 && val && strcmp(val, "trapezoid") == 0) 
+			rasterizer = RASTER_TRAPEZOID, i++;
+		else if (strcmp(arg, "-r") == 0 && val && strcmp(val, "halfspace") == 0) 
+			rasterizer = RASTER_HALFSPACE, i++;
+		else if (strcmp(arg, "-f") == 0 && val && strcmp(val, "bilinear") == 0) 
+			sampler = SAMPLER_BILINEAR, i++;
+		else if (strcmp(arg, "-f") == 0 && val && strcmp(val, "mip") == 0) 
+			sampler = SAMPLER_MIP, i++;
+		else if (strcmp(arg, "-f") == 0 && val && strcmp(val, "trilinear") == 0) 
+			sampler = SAMPLER_TRILINEAR, i++;
+		else if (strcmp(arg, "-t") == 0 && val) {
+			threads = (strcmp(val, "auto") == 0)? cpu_count() : atoi(val);
+			i++;
+		}
+		else if (strcmp(arg, "-s") == 0 && val) {
+			if (strcmp(val, "texture") == 0) state = RENDER_STATE_TEXTURE;
+			else if (strcmp(val, "color") == 0) state = RENDER_STATE_COLOR;
+			else if (strcmp(val, "wireframe") == 0) state = RENDER_STATE_WIREFRAME;
+			else if (strcmp(val, "normal") == 0) shader = &shader_normal, state = 0;
+			else state = atoi(val);
+			i++;
+		}
+		else {	// 未知选项或取值都打印用法，不猜默认值
+			fprintf(stderr, "usage: %s [-n frames] [-w width] [-h height] "
+				"[-s texture|color|wireframe|normal] [-d] [-z] [-g objects] [-i instances] [-c commands] [-r trapezoid|halfspace] "
+				"[-f bilinear|mip|trilinear] [-b float|unorm16|unorm24] [-t threads|auto] "
+				"[-j jobs] [-p buffers] [-o frame%%04d.png | job%%d_frame%%04d.png] "
+				"[-v video.y4m | video.bgra | job%%d.y4m | -] [-e y4m|bgra]\n", argv[0]);
+			return -1;
+		}
+	}
+	if (width <= 0 || height <= 0 || frames < 0 || count <= 0) return -1;
+	if (video && count > 1 && strcmp(video, "-") == 0) {
+		fprintf(stderr, "-v - writes one stream to stdout and cannot be used with -j %d\n", count);
+		return -1;
+	}
+	if (video && encoding < 0) {
+		size_t n = strlen(video);
+		encoding = (n >= 5 && strcmp(video + n - 5, ".bgra") == 0)? STREAM_BGRA : STREAM_Y4M;
+	}
+
+	jobs = (render_job_t*)malloc(sizeof(render_job_t) * count);
+	workers = (thread_t*)malloc(sizeof(thread_t) * count);
+	if (jobs == NULL || workers == NULL) return -1;
+
+	bits = checker_bits();
+	texture_init(&checker, bits, 256 * 4, 256, 256);
+	free(bits);
+	scene_init(&scene);
+	if (objects > 0) init_scene(&scene, objects);
+	grid = (instances > commands)? instances : commands;
+	if (grid > 0) {
+		worlds = (matrix_t*)malloc(sizeof(matrix_t) * grid);
+		if (worlds == NULL) return -1;
+		for (i = 0; i < grid; i++) grid_matrix(&worlds[i], i, grid);
+	}
+	if (instances > 0) {
+		colors = (color_t*)malloc(sizeof(color_t) * instances);
+		if (colors == NULL) return -1;
+		for (i = 0; i < instances; i++) {
+			colors[i].r = (float)((i * 37) % 256) / 255.0f;
+			colors[i].g = (float)((i * 91) % 256) / 255.0f;
+			colors[i].b = (float)((i * 53) % 256) / 255.0f;
+		}
+	}
+
+	memset(jobs, 0, sizeof(render_job_t) * count);
+	for (i = 0, ready = 1; i < count && ready; i++) {
+		render_job_t *job = &jobs[i];
+		if (video) {
+			char name[1024];
+			output_name(name, sizeof(name), video, &i, 1);
+			if (stream_open(&job->stream, name, encoding, width, height, 30) != 0) {
+				fprintf(stderr, "cannot open %s\n", name);
+				ready = 0;
+				continue;
+			}
+		}
+		if (swapchain_init(&job->chain, width, height, buffers, NULL, 
+				(output || video)? render_job_present : NULL, job)) {
+			ready = 0;
+			continue;
+		}
+		device_init_depth(&job->device, width, height, NULL, depth);
+		device_set_threads(&job->device, (prepass && threads == 0)? 1 : threads);
+		camera_at_zero(&job->device, 3, 0, 0);
+		device_bind_texture(&job->device, &checker);
+		job->device.render_state = state | deferred | prepass;
+		job->device.rasterizer = rasterizer;
+		job->device.shader = shader;
+		job->device.sampler = sampler;
+		job->width = width;
+		job->height = height;
+		job->output = output;
+		job->job = i;
+		job->jobs = count;
+		job->frames = frames;
+		job->done = 0;
+		job->scene = &scene;
+		job->objects = objects;
+		job->worlds = worlds;
+		job->colors = colors;
+		job->instances = instances;
+		job->commands = commands;
+		for (k = 0; k < 4; k++) cmdbuf_init(&job->buffers[k], job->device.render_state);
+	}
+
+	if (ready) {
+		start = timer_seconds();
+		if (count == 1) {
+			render_job(&jobs[0]);
+		}	else {
+			for (i = 0; i < count; i++) thread_create(&workers[i], render_job, &jobs[i]);
+			for (i = 0; i < count; i++) thread_join(&workers[i]);
+		}
+		elapsed = timer_seconds() - start;
+
+		for (i = 0, done = 0; i < count; i++) done += jobs[i].done;
+		fprintf((video && strcmp(video, "-") == 0)? stderr : stdout, 
+			"%d frames %dx%d in %.3fs: %.2f ms/frame, %.1f fps\n", done, width, height,
+			elapsed, (done > 0)? elapsed * 1000.0 / done : 0.0, (elapsed > 0)? done / elapsed : 0.0);
+	}
+
+	for (i = 0; i < count; i++) render_job_destroy(&jobs[i]);
+	free(jobs);
+	free(workers);
+	scene_destroy(&scene);
+	texture_destroy(&checker);
+	if (worlds) free(worlds);
+	if (colors) free(colors);
+	return ready? 0 : -1;
+}
+
+#else
+
 int main(void)
 {
 	device_t device;
+	swapchain_t chain;
+	IUINT32 *bits;
 	int states[] = { RENDER_STATE_TEXTURE, RENDER_STATE_COLOR, RENDER_STATE_WIREFRAME };
 	int indicator = 0;
 	int kbhit = 0;
@@ -1281,6 +4942,10 @@ int main(void)
 	if (screen_init(800, 600, title)) 
 		return -1;
 
+	// 显示线程 BitBlt 上一帧的同时渲染下一帧
+	if (swapchain_init(&chain, 800, 600, SCREEN_BUFFERS, screen_fb, screen_present_proc, NULL))
+		return -1;
+
 	device_init(&device, 800, 600, screen_fb);
 	camera_at_zero(&device, 3, 0, 0);
 
@@ -1289,6 +4954,9 @@ int main(void)
 
 	while (screen_exit == 0 && screen_keys[VK_ESCAPE] == 0) {
 		screen_dispatch();
+		bits = swapchain_acquire(&chain);
+		if (bits == NULL) break;
+		device_set_framebuffer(&device, bits);
 		device_clear(&device, 1);
 		camera_at_zero(&device, pos, 0, 0);
 		
@@ -1308,9 +4976,13 @@ int main(void)
 		}
 
 		draw_box(&device, alpha);
-		screen_update();
-		Sleep(1);
+		device_flush(&device);
+		swapchain_present(&chain);
 	}
+	swapchain_destroy(&chain);
+	device_destroy(&device);
 	return 0;
 }
 
+#endif	// MINI3D_HEADLESS
+